@@ -0,0 +1,12 @@
+/*
+ * minimal stand-in for <libkern/OSByteOrder.h> on non-Darwin hosts.
+ */
+
+#ifndef _COMPAT_LIBKERN_OSBYTEORDER_H
+#define _COMPAT_LIBKERN_OSBYTEORDER_H
+
+#include <stdint.h>
+
+#define OSSwapInt32(x)		__builtin_bswap32(x)
+
+#endif
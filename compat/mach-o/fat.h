@@ -0,0 +1,28 @@
+/*
+ * minimal stand-in for <mach-o/fat.h> on non-Darwin hosts.  fat headers are
+ * always stored big-endian.
+ */
+
+#ifndef _COMPAT_MACH_O_FAT_H
+#define _COMPAT_MACH_O_FAT_H
+
+#include <stdint.h>
+
+#include <mach-o/loader.h>
+
+#define FAT_MAGIC	0xcafebabe
+
+struct fat_header {
+	uint32_t	magic;
+	uint32_t	nfat_arch;
+};
+
+struct fat_arch {
+	cpu_type_t	cputype;
+	cpu_subtype_t	cpusubtype;
+	uint32_t	offset;
+	uint32_t	size;
+	uint32_t	align;
+};
+
+#endif
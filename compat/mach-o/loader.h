@@ -0,0 +1,149 @@
+/*
+ * minimal stand-in for <mach-o/loader.h> on non-Darwin hosts: the header,
+ * segment, section and linkedit structures the patcher reads and rewrites.
+ */
+
+#ifndef _COMPAT_MACH_O_LOADER_H
+#define _COMPAT_MACH_O_LOADER_H
+
+#include <stdint.h>
+
+typedef int		cpu_type_t;
+typedef int		cpu_subtype_t;
+typedef int		vm_prot_t;
+
+#define CPU_ARCH_ABI64		0x01000000
+#define CPU_TYPE_X86		((cpu_type_t) 7)
+#define CPU_TYPE_I386		CPU_TYPE_X86
+#define CPU_TYPE_X86_64		(CPU_TYPE_X86 | CPU_ARCH_ABI64)
+#define CPU_SUBTYPE_I386_ALL	((cpu_subtype_t) 3)
+#define CPU_SUBTYPE_X86_64_ALL	((cpu_subtype_t) 3)
+
+struct mach_header {
+	uint32_t	magic;
+	cpu_type_t	cputype;
+	cpu_subtype_t	cpusubtype;
+	uint32_t	filetype;
+	uint32_t	ncmds;
+	uint32_t	sizeofcmds;
+	uint32_t	flags;
+};
+
+#define MH_MAGIC	0xfeedface
+
+struct mach_header_64 {
+	uint32_t	magic;
+	cpu_type_t	cputype;
+	cpu_subtype_t	cpusubtype;
+	uint32_t	filetype;
+	uint32_t	ncmds;
+	uint32_t	sizeofcmds;
+	uint32_t	flags;
+	uint32_t	reserved;
+};
+
+#define MH_MAGIC_64	0xfeedfacf
+
+#define MH_EXECUTE	0x2
+#define MH_DYLIB	0x6
+
+struct load_command {
+	uint32_t	cmd;
+	uint32_t	cmdsize;
+};
+
+#define LC_SEGMENT		0x1
+#define LC_SYMTAB		0x2
+#define LC_SEGMENT_64		0x19
+#define LC_CODE_SIGNATURE	0x1d
+#define LC_FUNCTION_STARTS	0x26
+#define LC_DATA_IN_CODE		0x29
+#define LC_DYLIB_CODE_SIGN_DRS	0x2b
+
+struct segment_command {
+	uint32_t	cmd;
+	uint32_t	cmdsize;
+	char		segname[16];
+	uint32_t	vmaddr;
+	uint32_t	vmsize;
+	uint32_t	fileoff;
+	uint32_t	filesize;
+	vm_prot_t	maxprot;
+	vm_prot_t	initprot;
+	uint32_t	nsects;
+	uint32_t	flags;
+};
+
+struct segment_command_64 {
+	uint32_t	cmd;
+	uint32_t	cmdsize;
+	char		segname[16];
+	uint64_t	vmaddr;
+	uint64_t	vmsize;
+	uint64_t	fileoff;
+	uint64_t	filesize;
+	vm_prot_t	maxprot;
+	vm_prot_t	initprot;
+	uint32_t	nsects;
+	uint32_t	flags;
+};
+
+struct section {
+	char		sectname[16];
+	char		segname[16];
+	uint32_t	addr;
+	uint32_t	size;
+	uint32_t	offset;
+	uint32_t	align;
+	uint32_t	reloff;
+	uint32_t	nreloc;
+	uint32_t	flags;
+	uint32_t	reserved1;
+	uint32_t	reserved2;
+};
+
+struct section_64 {
+	char		sectname[16];
+	char		segname[16];
+	uint64_t	addr;
+	uint64_t	size;
+	uint32_t	offset;
+	uint32_t	align;
+	uint32_t	reloff;
+	uint32_t	nreloc;
+	uint32_t	flags;
+	uint32_t	reserved1;
+	uint32_t	reserved2;
+	uint32_t	reserved3;
+};
+
+#define SECTION_TYPE			0x000000ff
+#define S_ZEROFILL			0x1
+#define S_GB_ZEROFILL			0xc
+#define S_THREAD_LOCAL_ZEROFILL		0x12
+#define S_ATTR_PURE_INSTRUCTIONS	0x80000000
+#define S_ATTR_SOME_INSTRUCTIONS	0x00000400
+
+struct linkedit_data_command {
+	uint32_t	cmd;
+	uint32_t	cmdsize;
+	uint32_t	dataoff;
+	uint32_t	datasize;
+};
+
+struct symtab_command {
+	uint32_t	cmd;
+	uint32_t	cmdsize;
+	uint32_t	symoff;
+	uint32_t	nsyms;
+	uint32_t	stroff;
+	uint32_t	strsize;
+};
+
+struct data_in_code_entry {
+	uint32_t	offset;
+	uint16_t	length;
+	uint16_t	kind;
+};
+
+#endif
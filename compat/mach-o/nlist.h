@@ -0,0 +1,34 @@
+/*
+ * minimal stand-in for <mach-o/nlist.h> on non-Darwin hosts.
+ */
+
+#ifndef _COMPAT_MACH_O_NLIST_H
+#define _COMPAT_MACH_O_NLIST_H
+
+#include <stdint.h>
+
+struct nlist {
+	union {
+		uint32_t	n_strx;
+	} n_un;
+	uint8_t		n_type;
+	uint8_t		n_sect;
+	int16_t		n_desc;
+	uint32_t	n_value;
+};
+
+struct nlist_64 {
+	union {
+		uint32_t	n_strx;
+	} n_un;
+	uint8_t		n_type;
+	uint8_t		n_sect;
+	uint16_t	n_desc;
+	uint64_t	n_value;
+};
+
+#define N_STAB		0xe0
+#define N_TYPE		0x0e
+#define N_SECT		0xe
+
+#endif
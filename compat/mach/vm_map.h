@@ -0,0 +1,32 @@
+/*
+ * minimal stand-in for <mach/vm_map.h> on non-Darwin hosts: only the mach
+ * types and return codes used by the patcher.
+ */
+
+#ifndef _COMPAT_MACH_VM_MAP_H
+#define _COMPAT_MACH_VM_MAP_H
+
+#include <stdint.h>
+
+#include <libkern/OSByteOrder.h>
+
+typedef int		boolean_t;
+typedef int		kern_return_t;
+typedef uint64_t	mach_vm_offset_t;
+typedef uint64_t	mach_vm_size_t;
+
+#ifndef TRUE
+# define TRUE		1
+#endif
+#ifndef FALSE
+# define FALSE		0
+#endif
+
+#define KERN_SUCCESS		0
+#define KERN_FAILURE		5
+
+#ifndef __unused
+# define __unused	__attribute__((__unused__))
+#endif
+
+#endif
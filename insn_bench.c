@@ -0,0 +1,816 @@
+/*
+ * instruction length decoder benchmark
+ *
+ * decodes the __text section(s) of a Mach-O file (thin or universal) with and without the
+ * get_insn_length fast path, checks that both agree at every byte offset and reports the
+ * decoding rate of each, then the rate of scan_text_section over the same code and, with
+ * --patcher, of the whole tool on the file.
+ *
+ * --synthetic generates the file instead: a thin i386 or x86_64 image or a universal binary
+ * of both, with compiler-like code (see the synthetic corpus below), so the numbers can be
+ * taken on hosts without Mach-O files of their own.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <mach/vm_map.h>
+
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+
+#include "insn_patcher.h"
+
+#define DEFAULT_ROUNDS		5
+#define DEFAULT_TEXT_KB		4096
+#define DEFAULT_SITES		2	// patch sites per 1000 instructions
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* synthetic corpus: images whose __text is a run of functions -- a frame setup, a body of
+ * common integer and SSE instructions drawn by weight, a frame teardown -- padded to 16
+ * bytes with nops, with a zero-filled gap now and then.  the instructions the patcher
+ * rewrites (cpuid, the i386 sysenter trap, lddqu and fisttp) are sprinkled into the bodies
+ * at the given density.  the images also carry LC_FUNCTION_STARTS and a code signature blob
+ * (of random bytes), so they take the same paths through the tool as real ones. */
+
+#define SYNTH_TEXT_OFF		0x1000
+#define SYNTH_PAGE		0x1000
+
+#define T_MODRM			(1 << 0)	// followed by modrm (and sib, displacement)
+#define T_MEM			(1 << 1)	// modrm addresses memory
+#define T_REG			(1 << 2)	// register in the low 3 bits of the opcode
+#define T_REX			(1 << 3)	// may take REX.W on x86_64
+
+struct synth_insn {
+	uint8_t opcode[3];
+	uint8_t len;
+	uint8_t flags;
+	int8_t reg;		// modrm reg field, -1 if any
+	uint8_t imm;		// immediate bytes
+	uint8_t weight;
+};
+
+static const struct synth_insn synth_mix[] = {
+	{ { 0x89 }, 1, T_MODRM | T_REX, -1, 0, 20 },		// mov Ev,Gv
+	{ { 0x8b }, 1, T_MODRM | T_REX, -1, 0, 20 },		// mov Gv,Ev
+	{ { 0x8d }, 1, T_MODRM | T_MEM | T_REX, -1, 0, 8 },	// lea
+	{ { 0xc7 }, 1, T_MODRM | T_MEM | T_REX, 0, 4, 3 },	// mov Ev,Iz
+	{ { 0xb8 }, 1, T_REG, 0, 4, 3 },			// mov reg,Iz
+	{ { 0x50 }, 1, T_REG, 0, 0, 4 },			// push
+	{ { 0x58 }, 1, T_REG, 0, 0, 4 },			// pop
+	{ { 0x01 }, 1, T_MODRM | T_REX, -1, 0, 4 },		// add
+	{ { 0x29 }, 1, T_MODRM | T_REX, -1, 0, 3 },		// sub
+	{ { 0x31 }, 1, T_MODRM | T_REX, -1, 0, 3 },		// xor
+	{ { 0x85 }, 1, T_MODRM | T_REX, -1, 0, 5 },		// test
+	{ { 0x39 }, 1, T_MODRM | T_REX, -1, 0, 5 },		// cmp
+	{ { 0x83 }, 1, T_MODRM | T_REX, -1, 1, 8 },		// add .. cmp Ev,Ib
+	{ { 0xc1 }, 1, T_MODRM | T_REX, 4, 1, 2 },		// shl Ev,Ib
+	{ { 0xf7 }, 1, T_MODRM | T_REX, 3, 0, 1 },		// neg
+	{ { 0xe8 }, 1, 0, 0, 4, 5 },				// call rel32
+	{ { 0xff }, 1, T_MODRM | T_MEM, 2, 0, 1 },		// call Ev
+	{ { 0x74 }, 1, 0, 0, 1, 4 },				// je rel8
+	{ { 0x75 }, 1, 0, 0, 1, 4 },				// jne rel8
+	{ { 0xeb }, 1, 0, 0, 1, 2 },				// jmp rel8
+	{ { 0x0f, 0x84 }, 2, 0, 0, 4, 2 },			// je rel32
+	{ { 0x0f, 0xb6 }, 2, T_MODRM, -1, 0, 3 },		// movzx
+	{ { 0x0f, 0xaf }, 2, T_MODRM | T_REX, -1, 0, 1 },	// imul
+	{ { 0x0f, 0x44 }, 2, T_MODRM | T_REX, -1, 0, 1 },	// cmove
+	{ { 0x0f, 0x94 }, 2, T_MODRM, 0, 0, 1 },		// sete
+	{ { 0x0f, 0x28 }, 2, T_MODRM, -1, 0, 1 },		// movaps
+	{ { 0xf3, 0x0f, 0x10 }, 3, T_MODRM, -1, 0, 2 },		// movss
+	{ { 0xf2, 0x0f, 0x59 }, 3, T_MODRM, -1, 0, 1 },		// mulsd
+	{ { 0x66, 0x0f, 0xef }, 3, T_MODRM, -1, 0, 1 },		// pxor
+};
+
+struct synth_options {
+	uint32_t text_kb;
+	uint32_t sites;
+	uint64_t seed;
+};
+
+struct synth_stats {
+	uint64_t insns;
+	uint64_t sites;
+	uint64_t functions;
+	uint64_t padding;
+};
+
+struct synth_buf {
+	uint8_t *data;
+	uint64_t len, max;
+};
+
+static uint64_t synth_random(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void synth_emit(struct synth_buf *b, const void *bytes, uint64_t len)
+{
+	uint64_t max;
+	uint8_t *data;
+
+	if (b->len + len > b->max) {
+		max = b->max ? b->max : 65536;
+		while (b->len + len > max)
+			max *= 2;
+		data = realloc(b->data, max);
+		if (!data) {
+			printf("ERROR: out of memory\n");
+			exit(1);
+		}
+		b->data = data;
+		b->max = max;
+	}
+	if (bytes)
+		memcpy(b->data + b->len, bytes, len);
+	else
+		memset(b->data + b->len, 0, len);
+	b->len += len;
+}
+
+static void synth_byte(struct synth_buf *b, uint8_t byte)
+{
+	synth_emit(b, &byte, 1);
+}
+
+static void synth_random_bytes(struct synth_buf *b, uint64_t *rng, uint32_t len)
+{
+	while (len--)
+		synth_byte(b, (uint8_t) synth_random(rng));
+}
+
+/* synth_modrm: a modrm byte with reg (random if -1), and the sib and displacement it asks
+ * for; register forms are as common as memory forms unless mem_only */
+
+static void synth_modrm(struct synth_buf *b, uint64_t *rng, int reg, boolean_t mem_only)
+{
+	uint64_t r = synth_random(rng);
+	uint8_t mod, rm, sib;
+
+	mod = mem_only ? r % 3 : (r % 6 < 3 ? 3 : r % 3);
+	rm = (r >> 8) & 7;
+	if (reg < 0)
+		reg = (r >> 16) & 7;
+	synth_byte(b, (mod << 6) | (reg << 3) | rm);
+	if (mod == 3)
+		return;
+	if (rm == 4) {
+		sib = (uint8_t) (r >> 24);
+		synth_byte(b, sib);
+		if (!mod && ((sib & 7) == 5))
+			synth_random_bytes(b, rng, 4);
+	} else if (!mod && (rm == 5))
+		synth_random_bytes(b, rng, 4);
+	if (mod == 1)
+		synth_random_bytes(b, rng, 1);
+	else if (mod == 2)
+		synth_random_bytes(b, rng, 4);
+}
+
+static void synth_insn(struct synth_buf *b, uint64_t *rng, const struct synth_insn *t,
+		boolean_t is_64)
+{
+	uint64_t r = synth_random(rng);
+
+	if (is_64 && (t->flags & T_REX) && (r & 1))
+		synth_byte(b, 0x48 | ((r >> 1) & 7)); // REX.W with random R, X, B
+	synth_emit(b, t->opcode, t->len - 1);
+	synth_byte(b, t->opcode[t->len - 1] | ((t->flags & T_REG) ? (r >> 4) & 7 : 0));
+	if (t->flags & T_MODRM)
+		synth_modrm(b, rng, t->reg, (t->flags & T_MEM) != 0);
+	synth_random_bytes(b, rng, t->imm);
+}
+
+/* synth_site: one of the instructions the patcher rewrites; returns the number of
+ * instructions emitted */
+
+static uint32_t synth_site(struct synth_buf *b, uint64_t *rng, boolean_t is_64)
+{
+	static const uint8_t cpuid[] = { 0x0f, 0xa2 };
+	static const uint8_t lddqu[] = { 0xf2, 0x0f, 0xf0 };
+	static const uint8_t fisttp[] = { 0xdb, 0xdd, 0xdf };
+	/* popl %edx; movl %esp,%ecx; sysenter; nopl (%eax) */
+	static const uint8_t sysenter_trap[] = { 0x5a, 0x89, 0xe1, 0x0f, 0x34, 0x0f, 0x1f, 0x00 };
+	uint64_t r = synth_random(rng);
+
+	switch (r % (is_64 ? 3 : 4)) {
+	case 0:
+		synth_emit(b, cpuid, sizeof(cpuid));
+		return 1;
+	case 1:
+		synth_emit(b, lddqu, sizeof(lddqu));
+		synth_modrm(b, rng, -1, TRUE);
+		return 1;
+	case 2:
+		synth_byte(b, fisttp[(r >> 8) % 3]);
+		synth_modrm(b, rng, 1, TRUE);
+		return 1;
+	default:
+		synth_emit(b, sysenter_trap, sizeof(sysenter_trap));
+		return 4;
+	}
+}
+
+/* synth_text: generates opt->text_kb KB of code; the function starts (offsets in the text)
+ * go to starts */
+
+static void synth_text(struct synth_buf *text, struct synth_buf *starts, boolean_t is_64,
+		const struct synth_options *opt, uint64_t *rng, struct synth_stats *st)
+{
+	static const uint8_t prologue_32[] = { 0x55, 0x89, 0xe5 };		// push; mov %esp,%ebp
+	static const uint8_t prologue_64[] = { 0x55, 0x48, 0x89, 0xe5 };	// push; mov %rsp,%rbp
+	static const uint8_t epilogue[] = { 0x5d, 0xc3 };			// pop; ret
+	uint32_t total_weight = 0, n, k, len, w;
+	uint64_t r, start;
+
+	for (n = 0; n < sizeof(synth_mix) / sizeof(synth_mix[0]); n++)
+		total_weight += synth_mix[n].weight;
+
+	while (text->len < (uint64_t) opt->text_kb * 1024) {
+		start = text->len;
+		synth_emit(starts, &start, sizeof(start));
+		st->functions++;
+
+		if (is_64)
+			synth_emit(text, prologue_64, sizeof(prologue_64));
+		else
+			synth_emit(text, prologue_32, sizeof(prologue_32));
+		st->insns += 2;
+
+		len = 8 + synth_random(rng) % 120;
+		for (k = 0; k < len; k++) {
+			r = synth_random(rng);
+			if (r % 1000 < opt->sites) {
+				st->insns += synth_site(text, rng, is_64);
+				st->sites++;
+				continue;
+			}
+			w = (r >> 16) % total_weight;
+			for (n = 0; w >= synth_mix[n].weight; n++)
+				w -= synth_mix[n].weight;
+			synth_insn(text, rng, &synth_mix[n], is_64);
+			st->insns++;
+		}
+
+		synth_emit(text, epilogue, sizeof(epilogue));
+		st->insns += 2;
+
+		while (text->len % 16) {
+			synth_byte(text, 0x90);
+			st->padding++;
+		}
+		if (!(synth_random(rng) % 64)) {
+			len = 256 + synth_random(rng) % 2048;
+			synth_emit(text, NULL, len);
+			st->padding += len;
+		}
+	}
+}
+
+/* synth_uleb: appends value to b as uleb128 */
+
+static void synth_uleb(struct synth_buf *b, uint64_t value)
+{
+	do {
+		synth_byte(b, (value & 0x7f) | ((value >= 0x80) ? 0x80 : 0));
+		value >>= 7;
+	} while (value);
+}
+
+/* synth_slice: generates a thin image; returns it and its size in *size */
+
+static uint8_t *synth_slice(boolean_t is_64, const struct synth_options *opt, uint64_t *rng,
+		uint64_t *size, struct synth_stats *st)
+{
+	struct synth_buf text = { 0 }, starts = { 0 }, fstarts = { 0 }, image = { 0 };
+	struct linkedit_data_command fs_lc, sig_lc;
+	uint64_t text_seg, fs_off, sig_off, sig_size, linkedit_size, vmaddr, prev, n;
+	uint32_t sig_header[3];
+
+	synth_text(&text, &starts, is_64, opt, rng, st);
+
+	/* LC_FUNCTION_STARTS: uleb128 deltas from the start of __TEXT, ending with 0 */
+	prev = 0;
+	for (n = 0; n < starts.len / sizeof(uint64_t); n++) {
+		uint64_t start = SYNTH_TEXT_OFF + ((uint64_t *) starts.data)[n];
+		synth_uleb(&fstarts, start - prev);
+		prev = start;
+	}
+	synth_byte(&fstarts, 0);
+	while (fstarts.len % 8)
+		synth_byte(&fstarts, 0);
+
+	text_seg = (SYNTH_TEXT_OFF + text.len + SYNTH_PAGE - 1) & ~(uint64_t) (SYNTH_PAGE - 1);
+	fs_off = text_seg;
+	sig_off = fs_off + fstarts.len;
+	sig_size = 12 + 32 * (text_seg / SYNTH_PAGE);
+	sig_size = (sig_size + 15) & ~(uint64_t) 15;
+	linkedit_size = sig_off + sig_size - text_seg;
+	vmaddr = is_64 ? 0x100000000ULL : 0x1000;
+
+	fs_lc.cmd = LC_FUNCTION_STARTS;
+	fs_lc.cmdsize = sizeof(fs_lc);
+	fs_lc.dataoff = (uint32_t) fs_off;
+	fs_lc.datasize = (uint32_t) fstarts.len;
+	sig_lc.cmd = LC_CODE_SIGNATURE;
+	sig_lc.cmdsize = sizeof(sig_lc);
+	sig_lc.dataoff = (uint32_t) sig_off;
+	sig_lc.datasize = (uint32_t) sig_size;
+
+	if (is_64) {
+		struct mach_header_64 mh = { 0 };
+		struct segment_command_64 seg = { 0 }, linkedit = { 0 };
+		struct section_64 sect = { .sectname = "__text", .segname = "__TEXT" };
+
+		mh.magic = MH_MAGIC_64;
+		mh.cputype = CPU_TYPE_X86_64;
+		mh.cpusubtype = CPU_SUBTYPE_X86_64_ALL;
+		mh.filetype = MH_DYLIB;
+		mh.ncmds = 4;
+		mh.sizeofcmds = sizeof(seg) + sizeof(sect) + sizeof(linkedit) + 2 * sizeof(fs_lc);
+		seg.cmd = LC_SEGMENT_64;
+		seg.cmdsize = sizeof(seg) + sizeof(sect);
+		strcpy(seg.segname, "__TEXT");
+		seg.vmaddr = vmaddr;
+		seg.vmsize = seg.filesize = text_seg;
+		seg.maxprot = seg.initprot = 5;
+		seg.nsects = 1;
+		sect.addr = vmaddr + SYNTH_TEXT_OFF;
+		sect.size = text.len;
+		sect.offset = SYNTH_TEXT_OFF;
+		sect.align = 4;
+		sect.flags = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+		linkedit.cmd = LC_SEGMENT_64;
+		linkedit.cmdsize = sizeof(linkedit);
+		strcpy(linkedit.segname, "__LINKEDIT");
+		linkedit.vmaddr = vmaddr + text_seg;
+		linkedit.vmsize = (linkedit_size + SYNTH_PAGE - 1) & ~(uint64_t) (SYNTH_PAGE - 1);
+		linkedit.fileoff = text_seg;
+		linkedit.filesize = linkedit_size;
+		linkedit.maxprot = linkedit.initprot = 1;
+		synth_emit(&image, &mh, sizeof(mh));
+		synth_emit(&image, &seg, sizeof(seg));
+		synth_emit(&image, &sect, sizeof(sect));
+		synth_emit(&image, &linkedit, sizeof(linkedit));
+	} else {
+		struct mach_header mh = { 0 };
+		struct segment_command seg = { 0 }, linkedit = { 0 };
+		struct section sect = { .sectname = "__text", .segname = "__TEXT" };
+
+		mh.magic = MH_MAGIC;
+		mh.cputype = CPU_TYPE_I386;
+		mh.cpusubtype = CPU_SUBTYPE_I386_ALL;
+		mh.filetype = MH_DYLIB;
+		mh.ncmds = 4;
+		mh.sizeofcmds = sizeof(seg) + sizeof(sect) + sizeof(linkedit) + 2 * sizeof(fs_lc);
+		seg.cmd = LC_SEGMENT;
+		seg.cmdsize = sizeof(seg) + sizeof(sect);
+		strcpy(seg.segname, "__TEXT");
+		seg.vmaddr = (uint32_t) vmaddr;
+		seg.vmsize = seg.filesize = (uint32_t) text_seg;
+		seg.maxprot = seg.initprot = 5;
+		seg.nsects = 1;
+		sect.addr = (uint32_t) vmaddr + SYNTH_TEXT_OFF;
+		sect.size = (uint32_t) text.len;
+		sect.offset = SYNTH_TEXT_OFF;
+		sect.align = 4;
+		sect.flags = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+		linkedit.cmd = LC_SEGMENT;
+		linkedit.cmdsize = sizeof(linkedit);
+		strcpy(linkedit.segname, "__LINKEDIT");
+		linkedit.vmaddr = (uint32_t) (vmaddr + text_seg);
+		linkedit.vmsize = (uint32_t) ((linkedit_size + SYNTH_PAGE - 1) &
+				~(uint64_t) (SYNTH_PAGE - 1));
+		linkedit.fileoff = (uint32_t) text_seg;
+		linkedit.filesize = (uint32_t) linkedit_size;
+		linkedit.maxprot = linkedit.initprot = 1;
+		synth_emit(&image, &mh, sizeof(mh));
+		synth_emit(&image, &seg, sizeof(seg));
+		synth_emit(&image, &sect, sizeof(sect));
+		synth_emit(&image, &linkedit, sizeof(linkedit));
+	}
+	synth_emit(&image, &fs_lc, sizeof(fs_lc));
+	synth_emit(&image, &sig_lc, sizeof(sig_lc));
+
+	synth_emit(&image, NULL, SYNTH_TEXT_OFF - image.len);
+	synth_emit(&image, text.data, text.len);
+	synth_emit(&image, NULL, text_seg - image.len);
+	synth_emit(&image, fstarts.data, fstarts.len);
+
+	/* an embedded signature superblob (big-endian) of random hash slots */
+	sig_header[0] = OSSwapInt32(0xfade0cc0);
+	sig_header[1] = OSSwapInt32((uint32_t) sig_size);
+	sig_header[2] = 0;
+	synth_emit(&image, sig_header, sizeof(sig_header));
+	synth_random_bytes(&image, rng, (uint32_t) (sig_size - sizeof(sig_header)));
+
+	free(text.data);
+	free(starts.data);
+	free(fstarts.data);
+	*size = image.len;
+	return image.data;
+}
+
+/* synth_file: generates an i386 ("i386") or x86_64 ("x86_64") image, or a universal binary
+ * of both ("fat"); returns NULL for other kinds */
+
+static uint8_t *synth_file(const char *kind, const struct synth_options *opt, uint64_t *size,
+		struct synth_stats *st)
+{
+	struct synth_buf file = { 0 };
+	struct fat_header fh;
+	struct fat_arch arch[2];
+	uint8_t *slice[2];
+	uint64_t slice_size[2], off;
+	uint64_t rng = opt->seed ? opt->seed : 1;
+	uint32_t n;
+
+	memset(st, 0, sizeof(*st));
+	if (!strcmp(kind, "i386"))
+		return synth_slice(FALSE, opt, &rng, size, st);
+	if (!strcmp(kind, "x86_64"))
+		return synth_slice(TRUE, opt, &rng, size, st);
+	if (strcmp(kind, "fat"))
+		return NULL;
+
+	slice[0] = synth_slice(FALSE, opt, &rng, &slice_size[0], st);
+	slice[1] = synth_slice(TRUE, opt, &rng, &slice_size[1], st);
+	fh.magic = OSSwapInt32(FAT_MAGIC);
+	fh.nfat_arch = OSSwapInt32(2);
+	off = SYNTH_PAGE;
+	for (n = 0; n < 2; n++) {
+		arch[n].cputype = OSSwapInt32(n ? CPU_TYPE_X86_64 : CPU_TYPE_I386);
+		arch[n].cpusubtype = OSSwapInt32(n ? CPU_SUBTYPE_X86_64_ALL : CPU_SUBTYPE_I386_ALL);
+		arch[n].offset = OSSwapInt32((uint32_t) off);
+		arch[n].size = OSSwapInt32((uint32_t) slice_size[n]);
+		arch[n].align = OSSwapInt32(12);
+		off = (off + slice_size[n] + SYNTH_PAGE - 1) & ~(uint64_t) (SYNTH_PAGE - 1);
+	}
+	synth_emit(&file, &fh, sizeof(fh));
+	synth_emit(&file, arch, sizeof(arch));
+	for (n = 0; n < 2; n++) {
+		synth_emit(&file, NULL, OSSwapInt32(arch[n].offset) - file.len);
+		synth_emit(&file, slice[n], slice_size[n]);
+		free(slice[n]);
+	}
+	*size = file.len;
+	return file.data;
+}
+
+/* decode_section: linear sweep over the section; returns the number of instructions */
+
+static uint64_t decode_section(uint8_t *start, uint64_t size, boolean_t is_64bit)
+{
+	uint8_t *insn, *end;
+	uint64_t count = 0;
+	int32_t res;
+
+	end = start + size;
+	for (insn = start; insn < end; insn += res, count++) {
+		uint8_t status = 0;
+		res = get_insn_length(insn, is_64bit, &status);
+		if (res <= 0)
+			res = 1;
+	}
+	return count;
+}
+
+/* verify_section: compares the fast path with the full decoder at every byte offset */
+
+static uint64_t verify_section(uint8_t *start, uint64_t size, boolean_t is_64bit)
+{
+	uint64_t off, mismatches = 0;
+	int32_t *full;
+	uint8_t *full_status;
+
+	full = malloc(size * sizeof(int32_t));
+	full_status = malloc(size);
+	if (!full || !full_status) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+
+	init_insn_length_table(FALSE);
+	for (off = 0; off < size; off++) {
+		full_status[off] = 0;
+		full[off] = get_insn_length(start + off, is_64bit, &full_status[off]);
+	}
+
+	init_insn_length_table(TRUE);
+	for (off = 0; off < size; off++) {
+		uint8_t status = 0;
+		int32_t res = get_insn_length(start + off, is_64bit, &status);
+		if ((res != full[off]) || (status != full_status[off])) {
+			if (mismatches < 10)
+				printf("  mismatch at %08llx: fast %d/%x, full %d/%x\n",
+						(unsigned long long) off, res, status,
+						full[off], full_status[off]);
+			mismatches++;
+		}
+	}
+
+	free(full);
+	free(full_status);
+	return mismatches;
+}
+
+static double bench_section(uint8_t *start, uint64_t size, boolean_t is_64bit, boolean_t fast,
+		uint32_t rounds, uint64_t *count)
+{
+	double t, best = 0;
+	uint32_t n;
+
+	init_insn_length_table(fast);
+	for (n = 0; n < rounds; n++) {
+		t = now();
+		*count = decode_section(start, size, is_64bit);
+		t = now() - t;
+		if (!n || (t < best))
+			best = t;
+	}
+	return best;
+}
+
+/* bench_scan: times scan_text_section patching a fresh copy of the section (and the 16 bytes
+ * after it, which the decoder may look at) in every round */
+
+static double bench_scan(uint8_t *start, uint64_t size, uint64_t addr, boolean_t is_64bit,
+		uint32_t rounds, uint32_t *num_patches)
+{
+	double t, best = 0;
+	uint8_t *copy;
+	uint32_t n;
+
+	copy = malloc(size + 16);
+	if (!copy) {
+		printf("ERROR: out of memory\n");
+		exit(1);
+	}
+	init_insn_length_table(TRUE);
+	for (n = 0; n < rounds; n++) {
+		memcpy(copy, start, size + 16);
+		t = now();
+		scan_text_section(copy, size, addr, NULL, TRUE, is_64bit, FALSE, num_patches);
+		t = now() - t;
+		if (!n || (t < best))
+			best = t;
+	}
+	free(copy);
+	return best;
+}
+
+/* bench_slice: benchmarks the __text section of a thin image; adds its size and the number of
+ * instructions in it to *bytes and *insns */
+
+static int bench_slice(uint8_t *data, uint64_t size, uint32_t rounds, uint64_t *bytes,
+		uint64_t *insns)
+{
+	uint64_t text_size, text_offset, text_addr, count;
+	uint32_t num_patches = 0;
+	boolean_t is_64bit;
+	double slow, fast, scan;
+
+	if (*(uint32_t *) data == MH_MAGIC_64) {
+		struct section_64 *sect = getsectforpatch_64((struct mach_header_64 *) data,
+				"__TEXT", "__text");
+		if (!sect)
+			return -1;
+		text_size = sect->size;
+		text_offset = sect->offset;
+		text_addr = sect->addr;
+		is_64bit = TRUE;
+	} else if (*(uint32_t *) data == MH_MAGIC) {
+		struct section *sect = getsectforpatch((struct mach_header *) data,
+				"__TEXT", "__text");
+		if (!sect)
+			return -1;
+		text_size = sect->size;
+		text_offset = sect->offset;
+		text_addr = sect->addr;
+		is_64bit = FALSE;
+	} else
+		return -1;
+
+	/* stay clear of the end of the mapping (maximum instruction length is 15 bytes) */
+	if (text_offset + text_size + 16 > size) {
+		if (text_offset + 16 > size)
+			return -1;
+		text_size = size - text_offset - 16;
+	}
+
+	printf("%s __text: %llu bytes\n", is_64bit ? "x86_64" : "i386",
+			(unsigned long long) text_size);
+
+	count = verify_section(data + text_offset, text_size, is_64bit);
+	printf("  fast path vs full decoder: %llu mismatches\n", (unsigned long long) count);
+
+	slow = bench_section(data + text_offset, text_size, is_64bit, FALSE, rounds, &count);
+	fast = bench_section(data + text_offset, text_size, is_64bit, TRUE, rounds, &count);
+	printf("  full decoder: %8.2f Minsn/s %8.2f MB/s\n", count / slow / 1e6,
+			text_size / slow / 1e6);
+	printf("  fast path:    %8.2f Minsn/s %8.2f MB/s (%.2fx)\n", count / fast / 1e6,
+			text_size / fast / 1e6, slow / fast);
+
+	scan = bench_scan(data + text_offset, text_size, text_addr, is_64bit, rounds,
+			&num_patches);
+	printf("  scan:         %8.2f Minsn/s %8.2f MB/s (%u patches)\n", count / scan / 1e6,
+			text_size / scan / 1e6, num_patches);
+
+	*bytes += text_size;
+	*insns += count;
+	return 0;
+}
+
+/* bench_tool: times the tool (patcher, run as "patcher [--rules rules] file file.out") on
+ * the file */
+
+static int bench_tool(const char *patcher, const char *rules, const char *file,
+		uint64_t file_size, uint64_t insns, uint32_t rounds)
+{
+	double t, best = 0;
+	char *out;
+	pid_t pid;
+	uint32_t n;
+	int status, fd;
+
+	out = malloc(strlen(file) + 5);
+	if (!out)
+		return -1;
+	sprintf(out, "%s.out", file);
+	for (n = 0; n < rounds; n++) {
+		t = now();
+		pid = fork();
+		if (!pid) {
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0)
+				dup2(fd, STDOUT_FILENO);
+			if (rules)
+				execl(patcher, patcher, "--rules", rules, file, out, (char *) NULL);
+			else
+				execl(patcher, patcher, file, out, (char *) NULL);
+			_exit(127);
+		}
+		if ((pid < 0) || (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) ||
+				WEXITSTATUS(status)) {
+			printf("ERROR: Running %s failed\n", patcher);
+			unlink(out);
+			free(out);
+			return -1;
+		}
+		t = now() - t;
+		if (!n || (t < best))
+			best = t;
+	}
+	unlink(out);
+	free(out);
+
+	printf("end to end (%s): %8.2f Minsn/s %8.2f MB/s (%.3f s)\n", patcher,
+			insns / best / 1e6, file_size / best / 1e6, best);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] <mach-o file> [rounds]\n", name);
+	printf("       %s [options] --synthetic <i386|x86_64|fat> [rounds]\n", name);
+	printf("Options: --patcher <tool>  also time the tool on the file\n");
+	printf("         --size <KB>       size of the synthetic __text (default %u)\n",
+			DEFAULT_TEXT_KB);
+	printf("         --sites <n>       patch sites per 1000 synthetic instructions (default %u)\n",
+			DEFAULT_SITES);
+	printf("         --seed <n>        seed of the synthetic code (default 1)\n");
+	printf("         --save <file>     keep the synthetic file (it is deleted otherwise)\n");
+	printf("         --rules <list>    patch rules of the scan and the tool (default standard)\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct synth_options opt = { DEFAULT_TEXT_KB, DEFAULT_SITES, 1 };
+	struct synth_stats st;
+	struct stat sb;
+	struct fat_arch *arch;
+	const char *patcher = NULL, *synthetic = NULL, *save = NULL, *file = NULL;
+	const char *rules = NULL;
+	uint32_t rule_set;
+	char tmp[] = "/tmp/insn_bench.XXXXXX";
+	uint8_t *buffer;
+	uint64_t size, bytes = 0, insns = 0;
+	uint32_t rounds = DEFAULT_ROUNDS;
+	uint32_t n, nfat;
+	int argi, fd, ret = 0;
+
+	for (argi = 1; argi < argc; argi++) {
+		if (!strcmp(argv[argi], "--synthetic") && (argi + 1 < argc))
+			synthetic = argv[++argi];
+		else if (!strcmp(argv[argi], "--patcher") && (argi + 1 < argc))
+			patcher = argv[++argi];
+		else if (!strcmp(argv[argi], "--size") && (argi + 1 < argc))
+			opt.text_kb = atoi(argv[++argi]);
+		else if (!strcmp(argv[argi], "--sites") && (argi + 1 < argc))
+			opt.sites = atoi(argv[++argi]);
+		else if (!strcmp(argv[argi], "--seed") && (argi + 1 < argc))
+			opt.seed = strtoull(argv[++argi], NULL, 0);
+		else if (!strcmp(argv[argi], "--save") && (argi + 1 < argc))
+			save = argv[++argi];
+		else if (!strcmp(argv[argi], "--rules") && (argi + 1 < argc))
+			rules = argv[++argi];
+		else
+			break;
+	}
+	if (rules) {
+		if (!parse_patch_rules(rules, &rule_set)) {
+			printf("ERROR: unknown patch rule in %s\n", rules);
+			return 1;
+		}
+		select_patch_rules(rule_set);
+	}
+	if (!synthetic && (argi < argc))
+		file = argv[argi++];
+	if ((!synthetic && !file) || (argc - argi > 1)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (argi < argc)
+		rounds = atoi(argv[argi]);
+	if (!rounds)
+		rounds = 1;
+
+	if (synthetic) {
+		buffer = synth_file(synthetic, &opt, &size, &st);
+		if (!buffer) {
+			usage(argv[0]);
+			return 1;
+		}
+		printf("synthetic %s: %llu bytes, %llu functions, %llu instructions, "
+				"%llu patch sites, %llu padding bytes\n", synthetic,
+				(unsigned long long) size, (unsigned long long) st.functions,
+				(unsigned long long) st.insns, (unsigned long long) st.sites,
+				(unsigned long long) st.padding);
+		if (save || patcher) {
+			file = save;
+			fd = save ? open(save, O_WRONLY|O_CREAT|O_TRUNC, 0666) : mkstemp(tmp);
+			if (!save)
+				file = tmp;
+			if ((fd < 0) || (write(fd, buffer, size) != (ssize_t) size)) {
+				printf("ERROR: Writing %s failed\n", file);
+				return 2;
+			}
+			close(fd);
+		}
+	} else {
+		fd = open(file, O_RDONLY);
+		if ((fd < 0) || (fstat(fd, &sb) != 0) || (sb.st_size < 8)) {
+			printf("ERROR: Opening input file failed\n");
+			return 2;
+		}
+		size = sb.st_size;
+		buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (buffer == MAP_FAILED) {
+			printf("ERROR: Mapping input file failed\n");
+			return 2;
+		}
+	}
+
+	if (OSSwapInt32(*(uint32_t *) buffer) == FAT_MAGIC) {
+		nfat = OSSwapInt32(((struct fat_header *) buffer)->nfat_arch);
+		arch = (struct fat_arch *) (buffer + sizeof(struct fat_header));
+		for (n = 0; n < nfat; n++, arch++)
+			bench_slice(buffer + OSSwapInt32(arch->offset), OSSwapInt32(arch->size),
+					rounds, &bytes, &insns);
+	} else if (bench_slice(buffer, size, rounds, &bytes, &insns) != 0) {
+		printf("ERROR: Unsupported or no Mach-O file\n");
+		ret = 1;
+	}
+
+	if (!ret && patcher && (bench_tool(patcher, rules, file, size, insns, rounds) != 0))
+		ret = 3;
+
+	if (synthetic) {
+		if (file && !save)
+			unlink(file);
+		free(buffer);
+	}
+	return ret;
+}
@@ -13,14 +13,39 @@
 #define VERBOSE FALSE
 //#define VERBOSE TRUE
 
+#ifdef __linux__
+# define _GNU_SOURCE // copy_file_range
+#endif
+
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <dirent.h>
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <sys/sendfile.h>
+# include <linux/fs.h> // FICLONE
+#endif
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #include <mach/vm_map.h>
 
 #include <mach-o/fat.h>
 #include <mach-o/loader.h>
+#include <mach-o/nlist.h>
 
 #include "insn_patcher.h"
 
@@ -45,8 +70,8 @@
 #define OP_NEEDS_PATCH		(1 << 18)
 #define OP_SPECIAL		(1 << 19)
 
-#define OP_GROUP(n)		((n & 0xff) << 24)
-#define OP_GROUP_MASK		(0xff << 24)
+#define OP_GROUP(n)		((n & 0xffU) << 24)
+#define OP_GROUP_MASK		(0xffU << 24)
 #define OP_GROUP_EXTRACT(n)	((n >> 24) & 0xff)
 
 #define OP_OPERANDS		(OP_HAS_MODRM|OP_HAS_IMM8|OP_HAS_IMM16|OP_HAS_IMM32|	\
@@ -71,6 +96,21 @@
 #define PREF_SSE_ALL		(PREF_NONE|PREF_F3|PREF_66|PREF_F2)
 
 #define min(x,y)	((x < y) ? (x) : (y))
+#define max(x,y)	((x > y) ? (x) : (y))
+
+/* informational messages are suppressed in batch mode, errors are not */
+static boolean_t quiet = FALSE;
+
+/* --sparse: only decode around the byte patterns patch_insn could rewrite */
+static boolean_t sparse_scan = FALSE;
+
+/* --linear: ignore LC_FUNCTION_STARTS/LC_SYMTAB and sweep each section as one byte run */
+static boolean_t linear_scan = FALSE;
+
+/* --compact: cut the signature blobs out of __LINKEDIT instead of zeroing them */
+static boolean_t compact_output = FALSE;
+
+#define msg(...)	do { if (!quiet) printf(__VA_ARGS__); } while (0)
 
 uint32_t prefix_table[256] =
 {
@@ -91,10 +131,7 @@ enum {
 	GRP_4,		GRP_5,		GRP_6,		GRP_7,
 	GRP_8,		GRP_9,		GRP_10,		GRP_11,
 	GRP_12,		GRP_13,		GRP_14,		GRP_15,
-	GRP_16,		GRP_17A,	GRP_17B,
-#ifdef EXTENDED_PATCHER
-	GRP_FISTTP
-#endif
+	GRP_16,		GRP_17A,	GRP_17B,	GRP_FISTTP
 };
 
 uint32_t group_table[][8] = // inherits from parent table
@@ -119,11 +156,7 @@ uint32_t group_table[][8] = // inherits from parent table
 	},
 	[GRP_5] = { // group 5 (FF)
 		[0 ... 3] = OP_HAS_MODRM,		// {INC,DEC} Ev, CALL {Ev,Mp}
-#ifdef EXTENDED_PATCHER
-		[4 ... 5] = OP_HAS_MODRM|OP_SPECIAL,	// JMP {Ev,Mp}
-#else
-		[4 ... 5] = OP_HAS_MODRM,		// JMP {Ev,Mp}
-#endif
+		[4 ... 5] = OP_HAS_MODRM|OP_SPECIAL,	// JMP {Ev,Mp} (RULE_REST)
 		[6] = OP_HAS_MODRM,			// PUSH Ev
 		[7] = OP_UNDEFINED
 	},
@@ -192,13 +225,11 @@ uint32_t group_table[][8] = // inherits from parent table
 	[GRP_17B] = { // group 17b (0F 19..1F)
 		[0 ... 7] = OP_HAS_MODRM		// HINT_NOP Ev
 	},
-#ifdef EXTENDED_PATCHER
 	[GRP_FISTTP] = { // (DF, DB, DD)
 		[0] = OP_HAS_MODRM,
-		[1] = OP_HAS_MODRM|OP_NEEDS_PATCH,	// FISTTP
+		[1] = OP_HAS_MODRM|OP_NEEDS_PATCH,	// FISTTP (RULE_FISTTP)
 		[2 ... 7] = OP_HAS_MODRM
 	}
-#endif
 };
 
 uint32_t one_byte_table[256] =
@@ -451,7 +482,6 @@ uint32_t one_byte_table[256] =
 	OP_IA32_ONLY,			// D6: SALC
 	0,				// D7: XLAT{,B}
 
-#ifdef EXTENDED_PATCHER
 	OP_HAS_MODRM,			// D8: ESC to coprocessor
 	OP_HAS_MODRM,			// D9: ESC to coprocessor
 	OP_HAS_MODRM,			// DA: ESC to coprocessor
@@ -460,16 +490,6 @@ uint32_t one_byte_table[256] =
 	OP_GROUP(GRP_FISTTP),		// DD: ESC to coprocessor
 	OP_HAS_MODRM,			// DE: ESC to coprocessor
 	OP_GROUP(GRP_FISTTP),		// DF: ESC to coprocessor
-#else
-	OP_HAS_MODRM,			// D8: ESC to coprocessor
-	OP_HAS_MODRM,			// D9: ESC to coprocessor
-	OP_HAS_MODRM,			// DA: ESC to coprocessor
-	OP_HAS_MODRM,			// DB: ESC to coprocessor
-	OP_HAS_MODRM,			// DC: ESC to coprocessor
-	OP_HAS_MODRM,			// DD: ESC to coprocessor
-	OP_HAS_MODRM,			// DE: ESC to coprocessor
-	OP_HAS_MODRM,			// DF: ESC to coprocessor
-#endif
 
 	OP_HAS_IMM8,			// E0: LOOP{NE,NZ} Jb
 	OP_HAS_IMM8,			// E1: LOOP{E,Z} Jb
@@ -482,11 +502,7 @@ uint32_t one_byte_table[256] =
 
 	OP_CHECK_66,			// E8: CALL Jz
 	OP_CHECK_66,			// E9: JMP Jz
-#ifdef EXTENDED_PATCHER
-	OP_IA32_ONLY|OP_CHECK_66|OP_HAS_IMM16|OP_SPECIAL, // EA: JMP Ap
-#else
-	OP_IA32_ONLY|OP_CHECK_66|OP_HAS_IMM16, // EA: JMP Ap
-#endif
+	OP_IA32_ONLY|OP_CHECK_66|OP_HAS_IMM16|OP_SPECIAL, // EA: JMP Ap (RULE_REST)
 	OP_HAS_IMM8,			// EB: JMP Jb
 	0,				// EC: IN AL,DX
 	0,				// ED: IN eAX,DX
@@ -576,7 +592,7 @@ ext_opcode_t two_byte_table[256] = {
 	{ 0,				0 },				// 31: RDTSC
 	{ OP_SPECIAL,			0 },				// 32: RDMSR
 	{ 0,				0 },				// 33: RDPMC
-	{ OP_NEEDS_PATCH,		0 },				// 34: SYSENTER
+	{ OP_NEEDS_PATCH,		0 },				// 34: SYSENTER (RULE_SYSENTER_TRAP)
 	{ OP_SPECIAL,			0 },				// 35: SYSEXIT
 	{ OP_UNDEFINED,			0 },				// 36
 	{ OP_UNDEFINED,			0 },				// 37
@@ -700,7 +716,7 @@ ext_opcode_t two_byte_table[256] = {
 
 	{ OP_SPECIAL, 			0 },				// A0: PUSH FS
 	{ OP_SPECIAL, 			0 },				// A1: POP FS
-	{ OP_NEEDS_PATCH,	 	0 },				// A2: CPUID
+	{ OP_NEEDS_PATCH,	 	0 },				// A2: CPUID (RULE_CPUID)
 	{ OP_HAS_MODRM,			0 },	 			// A3: BT Ev,Gv
 	{ OP_HAS_MODRM|OP_HAS_IMM8,	0 },	 			// A4: SHLD Ev,Gv,Ib
 	{ OP_HAS_MODRM,			0 },	 			// A5: SHLD Ev,Gv,CL
@@ -789,11 +805,7 @@ ext_opcode_t two_byte_table[256] = {
 	{ OP_HAS_MODRM,			PREF_NONE|PREF_66 },		// EE: PMAXSW Pq,Qq / Vo,Wo
 	{ OP_HAS_MODRM,			PREF_NONE|PREF_66 },		// EF: PXOR Pq,Qq / Vo,Wo
 
-#ifdef EXTENDED_PATCHER
-	{ OP_HAS_MODRM|OP_NEEDS_PATCH,	PREF_F2 },			// F0: LDDQU Vo,Mo
-#else
-	{ OP_HAS_MODRM,			PREF_F2 },					// F0: LDDQU Vo,Mo
-#endif
+	{ OP_HAS_MODRM|OP_NEEDS_PATCH,	PREF_F2 },			// F0: LDDQU Vo,Mo (RULE_LDDQU)
 
 	{ OP_HAS_MODRM,			PREF_NONE|PREF_66 },		// F1: PSLLW Pq,Qq / Vo,Wo
 	{ OP_HAS_MODRM,			PREF_NONE|PREF_66 },		// F2: PSLLD Pq,Qq / Vo,Wo
@@ -938,6 +950,26 @@ ext_opcode_t three_byte_3a_table[256]  =
 	[0x64 ... 0xff] = { OP_UNDEFINED, 0 }				// 64 to FF: undefined and non-SSSE3 opcodes
 };
 
+/* fast path for get_insn_length: the overwhelming majority of instructions are a one-byte
+ * opcode with at most one prefix (66, or a REX byte on x86-64).  for those the length only
+ * depends on the opcode byte(s) and, if present, the modrm and sib bytes, so it can be looked
+ * up instead of decoded.  fast_length_table gives the length up to (not including) the modrm
+ * byte, or 0 if the full decoder has to be used (escapes, groups whose length depends on the
+ * reg field, OP_SPECIAL opcodes and anything that sets a status flag).  the tables are
+ * filled in by init_insn_length_table, which derives every entry from the full decoder. */
+
+#define FAST_MODRM		0x80	// fast_length_table: a modrm byte follows
+#define MODRM_SIB		0x80	// modrm_length_table: a sib byte with base 5 adds a disp32
+
+static const uint8_t fast_prefix_class[2][256] =
+{
+	{ [0x66] = 1 },
+	{ [0x66] = 1, [0x40 ... 0x47] = 2, [0x48 ... 0x4f] = 3 }
+};
+
+static uint8_t fast_length_table[2][4][256];
+static uint8_t modrm_length_table[256];
+
 /* get_insn_length: calculates the length of a single instruction
  *
  * arguments:  insn: (in) pointer to instruction
@@ -954,8 +986,26 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 	uint32_t prefix = 0; // all prefixes preceding opcode
 	uint8_t *eip = insn; // current location in instruction
 	uint8_t opcode; // last byte of opcode
+	uint32_t cls, entry, modrm_len;
+
+	cls = fast_prefix_class[is_64bit != 0][insn[0]];
+	entry = fast_length_table[is_64bit != 0][cls][insn[cls != 0]];
+	if (entry) {
+		if (!(entry & FAST_MODRM))
+			return entry;
+		eip = insn + (cls != 0) + 1;
+		modrm_len = modrm_length_table[eip[0]];
+		entry = (entry & ~FAST_MODRM) + (modrm_len & ~MODRM_SIB);
+		if ((modrm_len & MODRM_SIB) && ((eip[1] & 7) == 5))
+			entry += 4;
+		return entry;
+	}
 
+	/* no byte at or past insn + INSN_MAX_LEN can belong to the instruction, so none is read:
+	 * callers only need that many bytes to be there (see stream_window) */
 	do {
+		if (eip >= insn + INSN_MAX_LEN)
+			return INSN_INVALID;
 		flag &= ~(OP_PREFIX|OP_REX);
 		opcode = *eip++;
 		flag |= one_byte_table[opcode];
@@ -967,6 +1017,8 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 
 	if (flag & OP_TWOBYTE) {
 		ext_opcode_t *info;
+		if (eip >= insn + INSN_MAX_LEN)
+			return INSN_INVALID;
 		opcode = *eip++;
 		info = &two_byte_table[opcode];
 		flag |= info->flags;
@@ -978,6 +1030,8 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 				table = three_byte_3a_table;
 			else // shut up optimizer (never reached)
 				return INSN_INVALID;
+			if (eip >= insn + INSN_MAX_LEN)
+				return INSN_INVALID;
 			opcode = *eip++;
 			info = &table[opcode];
 			flag |= info->flags;
@@ -988,6 +1042,8 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 			flag |= OP_UNDEFINED;
 	}
 
+	if ((flag & (OP_GROUP_MASK|OP_HAS_MODRM)) && (eip >= insn + INSN_MAX_LEN))
+		return INSN_INVALID;
 	if (flag & OP_GROUP_MASK) {
 		uint8_t reg = (*eip & 0x38) >> 3;
 		flag |= group_table[OP_GROUP_EXTRACT(flag)][reg];
@@ -1067,14 +1123,12 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 					return 1;
 				}
 				break;
-#ifdef EXTENDED_PATCHER
 			case 0xff: // JMP Ev (FF/4) / JMP Mp (FF/5)
 			case 0xea: // JMP Ap
 				/* an absolute unconditional jump is often followed by garbage, so we inform
 				 * the calling function that what follows is probably invalid. */
 				*status |= STATUS_REST;
 				break;
-#endif
 			default:
 				return INSN_UNSUPPORTED;
 			}
@@ -1133,7 +1187,10 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 			else if (mod == 0 && rm == 5)
 				flag |= OP_HAS_DISP32;
 			if (mod < 3 && rm == 4) {
-				uint32_t sib_base = *eip++ & 0x7;
+				uint32_t sib_base;
+				if (eip >= insn + INSN_MAX_LEN)
+					return INSN_INVALID;
+				sib_base = *eip++ & 0x7;
 				if (mod == 0 && sib_base == 5)
 					flag |= OP_HAS_DISP32;
 			}
@@ -1155,9 +1212,292 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
 	if (flag & OP_HAS_DISP32)
 		eip += 4;
 
+	if (eip > insn + INSN_MAX_LEN)
+		return INSN_INVALID;
 	return (uint32_t) (eip - insn);
 }
 
+/* is_long_nop: whether insn is one of the multi-byte NOPs compilers align code with (0F 1F /0,
+ * with any 66 and 2E prefixes).  the sweeps count them as padding, one step per NOP. */
+
+static inline boolean_t is_long_nop(const uint8_t *insn)
+{
+	uint32_t n;
+
+	for (n = 0; (n < INSN_MAX_LEN - 3) && ((insn[n] == 0x66) || (insn[n] == 0x2e)); n++)
+		;
+	return (insn[n] == 0x0f) && (insn[n + 1] == 0x1f) && !(insn[n + 2] & 0x38);
+}
+
+/* user rules (--rule-file): masked byte patterns and their replacements, added with
+ * add_user_rule.  they are matched where the sweeps already are -- at the instruction
+ * starts of the linear decode -- so they take no pass of their own: scan_step looks the first
+ * byte of every instruction up in user_first and only compares the patterns of the rules that
+ * accept it (user_chain), which costs one table lookup per instruction.  a rule matches only
+ * within one instruction, from its start; a USER_RULE_WHOLE rule only if it covers all of
+ * it.  compile_user_rules builds the tables (from
+ * init_insn_length_table); the distinct first bytes also feed the candidate pre-filter. */
+
+static struct user_rule user_rules[USER_RULES_MAX];
+static uint32_t num_user_rules = 0;
+static uint8_t user_first[256]; // some rule accepts the byte
+static uint16_t user_chain_start[257]; // rules accepting byte b: user_chain[start[b], start[b + 1])
+static uint16_t user_chain[256 * USER_RULES_MAX];
+static uint8_t user_first_value[USER_RULES_MAX], user_first_mask[USER_RULES_MAX];
+static uint32_t num_user_first = 0; // distinct (value, mask) pairs of the first bytes
+
+/* add_user_rule: adds a rule.  returns FALSE if there are too many or the rule is malformed
+ * (longer than USER_RULE_MAX_LEN or with a first byte that doesn't compare any bit). */
+
+boolean_t add_user_rule(const struct user_rule *rule)
+{
+	struct user_rule *r;
+	uint32_t k;
+
+	if ((num_user_rules == USER_RULES_MAX) || !rule->len || (rule->len > USER_RULE_MAX_LEN) ||
+			!rule->mask[0])
+		return FALSE;
+	r = &user_rules[num_user_rules++];
+	*r = *rule;
+	for (k = 0; k < r->len; k++) {
+		r->value[k] &= r->mask[k];
+		r->replace[k] &= ~r->keep[k];
+	}
+	return TRUE;
+}
+
+static void compile_user_rules(void)
+{
+	uint32_t b, i, n = 0;
+
+	num_user_first = 0;
+	for (i = 0; i < num_user_rules; i++) {
+		for (b = 0; b < num_user_first; b++)
+			if ((user_first_value[b] == user_rules[i].value[0]) &&
+					(user_first_mask[b] == user_rules[i].mask[0]))
+				break;
+		if (b == num_user_first) {
+			user_first_value[num_user_first] = user_rules[i].value[0];
+			user_first_mask[num_user_first++] = user_rules[i].mask[0];
+		}
+	}
+	for (b = 0; b < 256; b++) {
+		user_chain_start[b] = n;
+		for (i = 0; i < num_user_rules; i++)
+			if ((b & user_rules[i].mask[0]) == user_rules[i].value[0])
+				user_chain[n++] = i;
+		user_first[b] = (n > user_chain_start[b]);
+	}
+	user_chain_start[256] = n;
+}
+
+/* match_user_rule: the first rule that matches at the start of the instruction of len bytes
+ * at insn, -1 if none does.  a rule never reaches past the instruction, so every sweep takes
+ * the same steps whether it patches as it goes or later.  rules that would reach beyond end
+ * (if not NULL) are skipped. */
+
+static int match_user_rule(uint8_t *insn, uint8_t *end, uint32_t len)
+{
+	const struct user_rule *r;
+	uint32_t i, k;
+
+	for (i = user_chain_start[insn[0]]; i < user_chain_start[insn[0] + 1]; i++) {
+		r = &user_rules[user_chain[i]];
+		if ((r->len > len) || ((r->boundary == USER_RULE_WHOLE) && (r->len != len)) ||
+				(end && (insn + r->len > end)))
+			continue;
+		for (k = 1; k < r->len; k++)
+			if ((insn[k] & r->mask[k]) != r->value[k])
+				break;
+		if (k == r->len)
+			return user_chain[i];
+	}
+	return -1;
+}
+
+static inline boolean_t user_rule_at(uint8_t *insn, uint8_t *end, uint32_t len)
+{
+	return num_user_rules && user_first[insn[0]] && (match_user_rule(insn, end, len) >= 0);
+}
+
+/* patch rules: what the patcher rewrites (and the rest heuristic) is selected at run time
+ * as a set of RULE_* bits.  a rule owns the decoder table flags that make get_insn_length
+ * report its instructions; init_insn_length_table sets them for the selected rules and clears
+ * them for the others, so the decoder and the fast path built from it only ever see the
+ * selected rules and the sweeps pay nothing for the rest.  classify_insn and the candidate
+ * pre-filter check the rule set themselves.  the default is RULES_EXTENDED for the extended
+ * patcher and RULES_STANDARD otherwise. */
+
+#ifdef EXTENDED_PATCHER
+static uint32_t patch_rules = RULES_EXTENDED;
+#else
+static uint32_t patch_rules = RULES_STANDARD;
+#endif
+
+static const struct {
+	uint32_t rule;
+	uint32_t *flags;
+	uint32_t bit;
+} rule_flags[] = {
+	{ RULE_CPUID,		&two_byte_table[0xa2].flags,	OP_NEEDS_PATCH },
+	{ RULE_SYSENTER_TRAP,	&two_byte_table[0x34].flags,	OP_NEEDS_PATCH },
+	{ RULE_LDDQU,		&two_byte_table[0xf0].flags,	OP_NEEDS_PATCH },
+	{ RULE_FISTTP,		&group_table[GRP_FISTTP][1],	OP_NEEDS_PATCH },
+	{ RULE_REST,		&group_table[GRP_5][4],		OP_SPECIAL },
+	{ RULE_REST,		&group_table[GRP_5][5],		OP_SPECIAL },
+	{ RULE_REST,		&one_byte_table[0xea],		OP_SPECIAL },
+};
+
+static const struct {
+	const char *name;
+	uint32_t rules;
+} rule_names[] = {
+	{ "cpuid",		RULE_CPUID },
+	{ "sysenter_trap",	RULE_SYSENTER_TRAP },
+	{ "lddqu",		RULE_LDDQU },
+	{ "fisttp",		RULE_FISTTP },
+	{ "rest",		RULE_REST },
+	{ "standard",		RULES_STANDARD },
+	{ "extended",		RULES_EXTENDED },
+};
+
+/* select_patch_rules: selects the rule set; takes effect with the next
+ * init_insn_length_table */
+
+void select_patch_rules(uint32_t rules)
+{
+	patch_rules = rules & RULES_EXTENDED;
+}
+
+uint32_t selected_patch_rules(void)
+{
+	return patch_rules;
+}
+
+/* parse_patch_rules: parses a comma separated list of rule names (see rule_names) into
+ * *rules.  returns FALSE if a name is unknown. */
+
+boolean_t parse_patch_rules(const char *list, uint32_t *rules)
+{
+	const char *end;
+	size_t len;
+	uint32_t n;
+
+	*rules = 0;
+	for (; *list; list = *end ? end + 1 : end) {
+		end = strchr(list, ',');
+		if (!end)
+			end = list + strlen(list);
+		len = end - list;
+		for (n = 0; n < sizeof(rule_names) / sizeof(rule_names[0]); n++)
+			if ((strlen(rule_names[n].name) == len) &&
+					!strncmp(rule_names[n].name, list, len))
+				break;
+		if (n == sizeof(rule_names) / sizeof(rule_names[0]))
+			return FALSE;
+		*rules |= rule_names[n].rules;
+	}
+	return TRUE;
+}
+
+/* init_insn_length_table: applies the selected patch rules (and compiles the user rules, see
+ * add_user_rule) to the decoder tables and fills
+ * in (enable) or clears (!enable) the get_insn_length fast path.  every entry is found by
+ * running the full decoder on the opcode with two different modrm bytes and all eight reg
+ * values, so the fast path can never disagree with it.  must be called before any thread
+ * starts decoding. */
+
+void init_insn_length_table(boolean_t enable)
+{
+	static uint8_t table[2][4][256];
+	static const uint8_t prefix_byte[4] = { 0, 0x66, 0x40, 0x48 };
+	uint8_t probe[32];
+	uint32_t mode, cls, opcode, reg, modrm, mod, rm, n;
+	int32_t len_reg, len_mem, len3, len2;
+	uint8_t status;
+
+	memset(fast_length_table, 0, sizeof(fast_length_table));
+	memset(modrm_length_table, 0, sizeof(modrm_length_table));
+	compile_user_rules();
+	for (n = 0; n < sizeof(rule_flags) / sizeof(rule_flags[0]); n++) {
+		if (patch_rules & rule_flags[n].rule)
+			*rule_flags[n].flags |= rule_flags[n].bit;
+		else
+			*rule_flags[n].flags &= ~rule_flags[n].bit;
+	}
+	if (!enable)
+		return;
+
+	for (modrm = 0; modrm < 256; modrm++) {
+		mod = modrm >> 6;
+		rm = modrm & 7;
+		n = 1;
+		if (mod == 1)
+			n += 1;
+		else if (mod == 2)
+			n += 4;
+		else if ((mod == 0) && (rm == 5))
+			n += 4;
+		if ((mod < 3) && (rm == 4)) {
+			n += 1;
+			if (mod == 0)
+				n |= MODRM_SIB;
+		}
+		modrm_length_table[modrm] = n;
+	}
+
+	memset(table, 0, sizeof(table));
+	for (mode = 0; mode < 2; mode++) {
+		for (cls = 0; cls < 4; cls++) {
+			if (!fast_prefix_class[mode][prefix_byte[cls]] && cls)
+				continue;
+			for (opcode = 0; opcode < 256; opcode++) {
+				uint32_t flags = one_byte_table[opcode];
+				if (mode == 0)
+					flags &= ~OP_REX;
+				if (flags & (OP_PREFIX|OP_REX|OP_TWOBYTE|OP_SPECIAL))
+					continue;
+
+				len_reg = len_mem = -1;
+				for (reg = 0; reg < 8; reg++) {
+					memset(probe, 0, sizeof(probe));
+					n = 0;
+					if (cls)
+						probe[n++] = prefix_byte[cls];
+					probe[n++] = opcode;
+
+					probe[n] = 0xc0 | (reg << 3); // mod 3: no sib or displacement
+					status = 0;
+					len3 = get_insn_length(probe, mode, &status);
+					if ((len3 <= 0) || status)
+						break;
+
+					probe[n] = 0x80 | (reg << 3); // mod 2, rm 0: disp32
+					status = 0;
+					len2 = get_insn_length(probe, mode, &status);
+					if ((len2 <= 0) || status)
+						break;
+
+					if ((reg && ((len3 != len_reg) || (len2 != len_mem))) ||
+							((len2 != len3) && (len2 != len3 + 4)))
+						break;
+					len_reg = len3;
+					len_mem = len2;
+				}
+				if ((reg != 8) || (len_reg >= FAST_MODRM))
+					continue;
+
+				if (len_mem == len_reg)
+					table[mode][cls][opcode] = len_reg;
+				else
+					table[mode][cls][opcode] = (len_reg - 1) | FAST_MODRM;
+			}
+		}
+	}
+
+	memcpy(fast_length_table, table, sizeof(table));
+}
+
 /* old sysenter_trap:
  *  +0	5a		popl %edx		[returned by check_sysenter_trap]
  *  +1	89e1		movl %esp,%ecx
@@ -1171,15 +1511,43 @@ int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status)
  *  +5	0f1f00		nopl (%eax)
  */
 
+/* instructions are not aligned, so multi-byte opcodes are read and written through these */
+
+static inline uint16_t peek16(const uint8_t *p)
+{
+	uint16_t x;
+
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline uint32_t peek32(const uint8_t *p)
+{
+	uint32_t x;
+
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline void poke16(uint8_t *p, uint16_t x)
+{
+	memcpy(p, &x, sizeof(x));
+}
+
+static inline void poke32(uint8_t *p, uint32_t x)
+{
+	memcpy(p, &x, sizeof(x));
+}
+
 uint8_t *check_sysenter_trap(uint8_t *insn)
 {
 	uint32_t peek_back, peek_ahead;
-	if (*(uint16_t *) insn != 0x340f)
+	if (peek16(insn) != 0x340f)
 		return (uint8_t *) -1;
-	peek_back = *(uint32_t *) (insn - 4);
+	peek_back = peek32(insn - 4);
 	if ((peek_back & 0xffffff00) != 0xe1895a00)
 		return (uint8_t *) -1;
-	peek_ahead = *(uint32_t *) (insn + 2);
+	peek_ahead = peek32(insn + 2);
 	if ((peek_ahead & 0x00ffffff) != 0x00001f0f)
 		return (uint8_t *) -1;
 	return (insn - 3);
@@ -1189,195 +1557,1213 @@ const uint8_t new_sysenter_trap[8] = { 0x59, 0xcd, 0xfc, 0x51, 0xc3, 0x0f, 0x1f,
 
 void patch_sysenter_trap(uint8_t *begin)
 {
-	*(uint32_t *) begin = *(const uint32_t *) new_sysenter_trap;
-	*(uint32_t *) (begin + 4) = *(const uint32_t *) (new_sysenter_trap + 4);
+	poke32(begin, peek32(new_sysenter_trap));
+	poke32(begin + 4, peek32(new_sysenter_trap + 4));
 }
 
-boolean_t patch_insn(uint8_t *insn, boolean_t verbose, boolean_t is_64bit)
+/* classify_insn: which patch (PATCH_*) the instruction at insn needs, PATCH_NONE if it is
+ * not one the patcher rewrites.  nothing is changed; apply_patch does that. */
+
+int classify_insn(uint8_t *insn, boolean_t is_64bit)
 {
-#ifdef EXTENDED_PATCHER
-	uint32_t opcode = *(uint32_t *) insn;
+	int32_t len;
+	uint8_t status = 0;
+	int rule;
+
+	if (num_user_rules && user_first[insn[0]] &&
+			((len = get_insn_length(insn, is_64bit, &status)) > 0) &&
+			!(status & STATUS_PADDING) && !is_long_nop(insn) &&
+			((rule = match_user_rule(insn, NULL, (uint32_t) len)) >= 0))
+		return PATCH_USER + rule;
 
-	if (((insn[0] & 0xf0) == 0xd0) &&
+	if ((patch_rules & RULE_FISTTP) && ((insn[0] & 0xf0) == 0xd0) &&
 			(((insn[1] >> 3) & 7) == 1)) {
 		switch (insn[0]) {
 			case 0xdf: /* word */
 			case 0xdb: /* dword */
-				insn[1] |= (3 << 3);
-				break;
 			case 0xdd: /* qword */
-				insn[0] = 0xdf;
-				insn[1] |= (7 << 3);
-				break;
+				return PATCH_FISTTP;
 			default:
-				return FALSE;
+				return PATCH_NONE;
 		}
+	}
+
+	if ((patch_rules & RULE_LDDQU) && ((peek32(insn) & 0x00ffffff) == LDDQU))
+		return PATCH_LDDQU;
+
+	if ((patch_rules & RULE_CPUID) && (peek16(insn) == CPUID))
+		return PATCH_CPUID;
+
+	if ((patch_rules & RULE_SYSENTER_TRAP) && !is_64bit && (peek16(insn) == SYSENTER) &&
+			(check_sysenter_trap(insn) != (uint8_t *) -1))
+		return PATCH_SYSENTER_TRAP;
+
+	return PATCH_NONE;
+}
+
+/* apply_patch: rewrites the instruction at insn, which classify_insn found to need kind */
+
+void apply_patch(uint8_t *insn, int kind, boolean_t verbose)
+{
+	const struct user_rule *r;
+	uint32_t opcode, k;
+
+	if (kind >= PATCH_USER) {
+		r = &user_rules[kind - PATCH_USER];
 		if (verbose)
-			printf("(patching fisttp to fistp)\n");
-		return TRUE;
+			printf("(applying rule %s)\n", r->name);
+		for (k = 0; k < r->len; k++)
+			insn[k] = (insn[k] & r->keep[k]) | r->replace[k];
+		return;
 	}
 
-	if ((opcode & 0x00ffffff) == LDDQU) {
+	switch (kind) {
+	case PATCH_FISTTP:
+		if (verbose)
+			printf("(patching fisttp to fistp)\n");
+		if (insn[0] == 0xdd) { /* qword */
+			insn[0] = 0xdf;
+			insn[1] |= (7 << 3);
+		} else /* word, dword */
+			insn[1] |= (3 << 3);
+		break;
+	case PATCH_LDDQU:
 		if (verbose)
 			printf("(patching lddqu to movdqu)\n");
+		opcode = peek32(insn);
 		opcode &= 0xff000000; /* clear opcode, leave operand */
 		opcode |= 0x006f0ff3; /* patch with movdqu */
-		*(uint32_t *) insn = opcode;
-		return TRUE;
-	}
-#endif
-
-	if (*(uint16_t *) insn == CPUID) {
+		poke32(insn, opcode);
+		break;
+	case PATCH_CPUID:
 		if (verbose)
 			printf("(patching cpuid to int 0xfb)\n");
-		*(uint16_t *) insn = 0xfbcd; /* int 0xfb */
-		return TRUE;
-	}
-
-	if (!is_64bit && (*(uint16_t *) insn == SYSENTER)) {
-		uint8_t *begin = check_sysenter_trap(insn);
-		if (begin == (uint8_t *) -1)
-			return FALSE;
+		poke16(insn, 0xfbcd); /* int 0xfb */
+		break;
+	case PATCH_SYSENTER_TRAP:
 		if (verbose)
 			printf("(patching sysenter_trap)\n");
-		patch_sysenter_trap(begin);
-		return TRUE;
+		patch_sysenter_trap(check_sysenter_trap(insn));
+		break;
 	}
-
-	return FALSE;
 }
 
-uint32_t scan_text_section(uint8_t *start, uint64_t size, uint64_t text_addr,
-		boolean_t should_patch, boolean_t abi_is_64, boolean_t verbose,
-		uint32_t *num_patches_out)
+boolean_t patch_insn(uint8_t *insn, boolean_t verbose, boolean_t is_64bit)
 {
-	int32_t res;
-	uint8_t *insn, *end, *last_bad;
-	uint32_t num_bad, num_patches;
+	int kind = classify_insn(insn, is_64bit);
 
-	insn = start;
-	end = start + size;
-	last_bad = NULL;
-	num_bad = 0;
-	num_patches = 0;
+	if (kind == PATCH_NONE)
+		return FALSE;
+	apply_patch(insn, kind, verbose);
+	return TRUE;
+}
 
-	if (verbose) {
-		uint64_t addr = text_addr;
-		for (res = 0; insn < end; insn += res, addr += res) {
-			uint8_t status = 0;
-			res = get_insn_length(insn, abi_is_64, &status);
-			if (res == INSN_INVALID) {
-				printf("%08llx: (bad)\n", addr);
-				res = 1;
-				last_bad = insn;
-				num_bad++;
-			} else if (res == INSN_UNSUPPORTED) {
-				printf("%08llx: (unsupported)\n", addr);
-				res = 1;
-				last_bad = insn;
-				num_bad++;
-			} else if (status) {
-				if (status & STATUS_PADDING) {
-					uint32_t n;
-					for (n = 1; (insn + n) < end; n++)
-						if (insn[n] != insn[0])
-							break;
-					printf("%08llx: (%d bytes padding)\n", addr, n);
-					res = n;
-					continue;
-				}
-#ifdef EXTENDED_PATCHER
-				if (status & STATUS_REST) {
-					last_bad = insn;
-					printf("%08llx: (will rest)\n", addr);
-				}
-#endif
-				if (!(status & STATUS_NEEDS_PATCH))
-					continue;
-				printf("%08llx: ", addr);
-				if (!should_patch || ((insn - last_bad) <= REST_SIZE)) {
-					printf("(skipped patch)\n");
-					continue;
-				}
-				if (!patch_insn(insn, verbose, abi_is_64))
-					printf("(unrecognized patch)\n");
-				else
-					num_patches++;
-			}
-		}
-	} else {
-		for (res = 0; insn < end; insn += res) {
-			uint8_t status = 0;
-			res = get_insn_length(insn, abi_is_64, &status);
-			if (res <= 0) { /* INSN_INVALID or INSN_UNSUPPORTED */
-				res = 1;
-				last_bad = insn;
-				num_bad++;
-			} else {
-#ifdef EXTENDED_PATCHER
-				if (status & (STATUS_REST|STATUS_PADDING)) {
-					if (status & STATUS_PADDING) {
-						uint32_t n;
-						for (n = 1; (insn + n) < end; n++)
-							if (insn[n] != insn[0])
-								break;
-						res = n;
-						continue;
-					} else
-						last_bad = insn;
-				}
-#else
-				if (status & STATUS_PADDING) {
-					uint32_t n;
-					for (n = 1; (insn + n) < end; n++)
-						if (insn[n] != insn[0])
-							break;
-					res = n;
-					continue;
-				}
-#endif
-				if ((status & STATUS_NEEDS_PATCH) && should_patch &&
-						((insn - last_bad) > REST_SIZE) &&
-						patch_insn(insn, verbose, abi_is_64))
-					num_patches++;
-			}
-		}
-	}
+/* parallel helpers: parallel_for runs fn(ctx, 0 .. count - 1) on the calling thread and on as
+ * many helper threads as are left in the global thread budget.  nested calls (e.g. from a
+ * slice worker) simply get whatever part of the budget is still unused, so the total number
+ * of running threads never exceeds the number of online processors. */
 
-	*num_patches_out = num_patches;
+#define MAX_THREADS		64
 
-	return num_bad;
+typedef void (*parallel_fn_t)(void *ctx, uint32_t index);
+
+struct parallel_job {
+	parallel_fn_t fn;
+	void *ctx;
+	uint32_t count;
+	uint32_t next;
+};
+
+static uint32_t threads_in_use = 1; // the main thread
+
+static uint32_t thread_limit(void)
+{
+	static uint32_t limit;
+	uint32_t n;
+	long ncpu;
+
+	n = __atomic_load_n(&limit, __ATOMIC_RELAXED);
+	if (!n) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (ncpu < 1) ? 1 : min((uint32_t) ncpu, MAX_THREADS);
+		__atomic_store_n(&limit, n, __ATOMIC_RELAXED);
+	}
+	return n;
 }
 
-/* segment loading routines (for patching). */
+static uint32_t reserve_threads(uint32_t want)
+{
+	uint32_t used, take;
 
-#define DEFINE_GETSEG(x)									\
-\
-struct segment_command##x *getsegforpatch##x(struct mach_header##x *header,		\
-const char *seg_name)								\
-{												\
-struct segment_command##x *sgp;								\
-uint32_t i;										\
-\
-sgp = (struct segment_command##x *) ((char *) header + sizeof (struct mach_header##x));	\
-for (i = 0; i < header->ncmds; i++) {							\
-if (sgp->cmd == LC_SEGMENT##x && !strncmp(sgp->segname, seg_name,		\
-sizeof (sgp->segname)))						\
-return sgp;								\
-sgp = (struct segment_command##x *) ((char *) sgp + sgp->cmdsize);		\
-}											\
-\
-return NULL;										\
+	do {
+		used = __atomic_load_n(&threads_in_use, __ATOMIC_RELAXED);
+		if (used >= thread_limit())
+			return 0;
+		take = min(want, thread_limit() - used);
+	} while (!__atomic_compare_exchange_n(&threads_in_use, &used, used + take, FALSE,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return take;
 }
 
-DEFINE_GETSEG()
-DEFINE_GETSEG(_64)
+static void release_threads(uint32_t n)
+{
+	if (n)
+		__atomic_fetch_sub(&threads_in_use, n, __ATOMIC_RELAXED);
+}
 
-#define DEFINE_GETSECT(x)									\
-\
-struct section##x *getsectforpatch##x(struct mach_header##x *header,			\
-const char *segname, const char *sectname)					\
-{												\
+static void *parallel_worker(void *arg)
+{
+	struct parallel_job *job = arg;
+	uint32_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+		job->fn(job->ctx, i);
+
+	return NULL;
+}
+
+static void parallel_for(uint32_t count, parallel_fn_t fn, void *ctx)
+{
+	pthread_t threads[MAX_THREADS];
+	struct parallel_job job = { fn, ctx, count, 0 };
+	uint32_t n, got;
+
+	got = (count > 1) ? reserve_threads(count - 1) : 0;
+	for (n = 0; n < got; n++)
+		if (pthread_create(&threads[n], NULL, parallel_worker, &job) != 0)
+			break;
+	release_threads(got - n);
+
+	parallel_worker(&job);
+
+	got = n;
+	for (n = 0; n < got; n++)
+		pthread_join(threads[n], NULL);
+	release_threads(got);
+}
+
+/* STATUS_BAD is only used inside the scanner: scan_step reports an invalid or unsupported
+ * instruction with it (and a length of 1, as the serial loops always did). */
+#define STATUS_BAD		(1 << 7)
+
+/* STATUS_SKIPPED marks, in an analysis, an instruction that needs a patch but is left alone
+ * because it follows a bad (or resting) instruction too closely. */
+#define STATUS_SKIPPED		(1 << 6)
+
+/* vector compares, 16 (SSE2) or 32 (AVX2) bytes at a time, for the padding runs and the
+ * candidate pre-filter (see next_patch_candidate).  without either, both fall back to their
+ * byte loops. */
+
+#if defined(__AVX2__)
+# define CAND_VEC		32
+typedef __m256i cand_vec_t;
+# define cand_load(p)		_mm256_loadu_si256((const __m256i *) (p))
+# define cand_set1(b)		_mm256_set1_epi8((char) (b))
+# define cand_eq(a, b)		_mm256_cmpeq_epi8(a, b)
+# define cand_and(a, b)		_mm256_and_si256(a, b)
+# define cand_or(a, b)		_mm256_or_si256(a, b)
+# define cand_mask(a)		((uint32_t) _mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+# define CAND_VEC		16
+typedef __m128i cand_vec_t;
+# define cand_load(p)		_mm_loadu_si128((const __m128i *) (p))
+# define cand_set1(b)		_mm_set1_epi8((char) (b))
+# define cand_eq(a, b)		_mm_cmpeq_epi8(a, b)
+# define cand_and(a, b)		_mm_and_si128(a, b)
+# define cand_or(a, b)		_mm_or_si128(a, b)
+# define cand_mask(a)		((uint32_t) _mm_movemask_epi8(a))
+#endif
+
+/* fill_run: the length of the run of fill bytes (00 00 and 90, see get_insn_length) that
+ * starts at insn, measured a vector at a time.  a sweep steps over the whole run at once.
+ * multi-byte NOPs (is_long_nop) are padding too, but each of them stays a step of its own:
+ * insn_map records every instruction start, and resync_window_safe relies on the linear
+ * decode having one in every window that isn't a fill run. */
+
+static inline uint32_t fill_run(const uint8_t *insn, const uint8_t *end)
+{
+	uint32_t n = 1;
+#ifdef CAND_VEC
+	cand_vec_t fill = cand_set1(insn[0]);
+	uint32_t mask;
+
+	for (; insn + n + CAND_VEC <= end; n += CAND_VEC) {
+		mask = ~cand_mask(cand_eq(cand_load(insn + n), fill)) &
+				(uint32_t) ((1ULL << CAND_VEC) - 1);
+		if (mask)
+			return n + __builtin_ctz(mask);
+	}
+#endif
+	for (; (insn + n) < end; n++)
+		if (insn[n] != insn[0])
+			break;
+	return n;
+}
+
+/* scan_step: decodes one step of the linear sweep at insn -- a single instruction, a run of
+ * padding bytes, a multi-byte NOP or one bad byte -- and returns its length.  scan_step_to
+ * bounds the user rules by rule_end instead of end (the streamed sweep stops its steps at the
+ * window, but its rules at the end of the function or section, as the other sweeps do). */
+
+static inline uint32_t scan_step_to(uint8_t *insn, uint8_t *end, uint8_t *rule_end,
+		boolean_t abi_is_64, uint8_t *status)
+{
+	int32_t res;
+
+	*status = 0;
+	res = get_insn_length(insn, abi_is_64, status);
+	if (res <= 0) { /* INSN_INVALID or INSN_UNSUPPORTED */
+		*status = STATUS_BAD;
+		return 1;
+	}
+	if (*status & STATUS_PADDING)
+		return fill_run(insn, end);
+	if (is_long_nop(insn)) {
+		*status |= STATUS_PADDING;
+		return (uint32_t) res;
+	}
+	if (user_rule_at(insn, rule_end, (uint32_t) res))
+		*status |= STATUS_NEEDS_PATCH;
+	return (uint32_t) res;
+}
+
+static inline uint32_t scan_step(uint8_t *insn, uint8_t *end, boolean_t abi_is_64, uint8_t *status)
+{
+	return scan_step_to(insn, end, end, abi_is_64, status);
+}
+
+/* data ranges: the sweep never decodes inside one.  a step that reaches the beginning of a
+ * range continues at its end, so every range end is an instruction start of the sweep.  the
+ * cursor keeps the check O(1) per step; data_seek positions it for a sweep that starts in
+ * the middle of the section. */
+
+struct data_cursor {
+	const struct data_range *ranges;
+	uint32_t num, next;
+};
+
+static inline void data_seek(struct data_cursor *c, const struct data_ranges *data, uint64_t off)
+{
+	uint32_t lo = 0, hi, mid;
+
+	c->ranges = data ? data->ranges : NULL;
+	c->num = hi = data ? data->num : 0;
+	while (lo < hi) { // first range ending after off
+		mid = lo + (hi - lo) / 2;
+		if (c->ranges[mid].end <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	c->next = lo;
+}
+
+static inline uint64_t data_skip(struct data_cursor *c, uint64_t off)
+{
+	/* a step may end inside a range or beyond it, but the sweep never moves back */
+	for (; (c->next < c->num) && (off >= c->ranges[c->next].begin); c->next++)
+		off = max(off, c->ranges[c->next].end);
+	return off;
+}
+
+/* scan_events is a growable list of (offset, status) pairs, used wherever a sweep records
+ * what it found instead of acting on it right away. */
+
+struct scan_event {
+	uint64_t off;
+	uint8_t status;
+};
+
+struct scan_events {
+	struct scan_event *events;
+	uint32_t num, max;
+	boolean_t failed;
+};
+
+static void scan_events_add(struct scan_events *ev, uint64_t off, uint8_t status)
+{
+	struct scan_event *events;
+
+	if (ev->num == ev->max) {
+		ev->max = ev->max ? ev->max * 2 : 256;
+		events = realloc(ev->events, ev->max * sizeof(struct scan_event));
+		if (!events) {
+			ev->failed = TRUE;
+			return;
+		}
+		ev->events = events;
+	}
+	ev->events[ev->num].off = off;
+	ev->events[ev->num].status = status;
+	ev->num++;
+}
+
+/* instruction maps (see struct insn_map): bit n of word n / 64 stands for byte n.  the sweeps
+ * that decode everything record into one as they go (map_record, map_record_shared where
+ * jobs share the words at their edges); insn_map_find and insn_map_count then answer
+ * questions about the decode with ctz and popcount instead of decoding again. */
+
+#define MAP_WORDS(size)		(((size) + 63) >> 6)
+
+static inline boolean_t map_test(const uint64_t *bits, uint64_t off)
+{
+	return (bits[off >> 6] >> (off & 63)) & 1;
+}
+
+static inline void map_record(struct insn_map *map, uint64_t off, uint8_t status)
+{
+	map->starts[off >> 6] |= 1ULL << (off & 63);
+	if (status & STATUS_BAD)
+		map->bad[off >> 6] |= 1ULL << (off & 63);
+}
+
+static inline void map_record_shared(struct insn_map *map, uint64_t off, uint8_t status)
+{
+	__atomic_fetch_or(&map->starts[off >> 6], 1ULL << (off & 63), __ATOMIC_RELAXED);
+	if (status & STATUS_BAD)
+		__atomic_fetch_or(&map->bad[off >> 6], 1ULL << (off & 63), __ATOMIC_RELAXED);
+}
+
+/* map_clear: clears [begin, end) in both bitmaps */
+
+static void map_clear(struct insn_map *map, uint64_t begin, uint64_t end)
+{
+	uint64_t mask;
+
+	for (; begin < end; begin = (begin | 63) + 1) {
+		mask = ~0ULL << (begin & 63);
+		if (end - (begin & ~63ULL) < 64)
+			mask &= ~(~0ULL << (end & 63));
+		map->starts[begin >> 6] &= ~mask;
+		map->bad[begin >> 6] &= ~mask;
+	}
+}
+
+boolean_t alloc_insn_map(struct insn_map *map, uint64_t size)
+{
+	map->size = size;
+	map->starts = calloc(MAP_WORDS(size) ? MAP_WORDS(size) : 1, sizeof(uint64_t));
+	map->bad = calloc(MAP_WORDS(size) ? MAP_WORDS(size) : 1, sizeof(uint64_t));
+	if (map->starts && map->bad)
+		return TRUE;
+	free_insn_map(map);
+	return FALSE;
+}
+
+void free_insn_map(struct insn_map *map)
+{
+	free(map->starts);
+	free(map->bad);
+	map->starts = map->bad = NULL;
+	map->size = 0;
+}
+
+/* insn_map_find: the first offset in [off, end) whose bit is set (or clear, with !set), end
+ * if there is none */
+
+uint64_t insn_map_find(const uint64_t *bits, uint64_t off, uint64_t end, boolean_t set)
+{
+	uint64_t w;
+
+	while (off < end) {
+		w = set ? bits[off >> 6] : ~bits[off >> 6];
+		w &= ~0ULL << (off & 63);
+		if (w)
+			return min((off & ~63ULL) + __builtin_ctzll(w), end);
+		off = (off | 63) + 1;
+	}
+	return end;
+}
+
+/* insn_map_count: the number of bits set in [begin, end) */
+
+uint64_t insn_map_count(const uint64_t *bits, uint64_t begin, uint64_t end)
+{
+	uint64_t n = 0, w;
+
+	for (; begin < end; begin = (begin | 63) + 1) {
+		w = bits[begin >> 6] & (~0ULL << (begin & 63));
+		if (end - (begin & ~63ULL) < 64)
+			w &= ~(~0ULL << (end & 63));
+		n += __builtin_popcountll(w);
+	}
+	return n;
+}
+
+/* patch journal: every change made to an image is recorded as an extent -- its offset in
+ * the image and the bytes before and after the change.  the extents are kept in the order
+ * they were made; journal_sort orders them by offset and merges those that overlap or
+ * touch, keeping the oldest old and the newest new bytes.  jobs that patch in parallel
+ * record into journals of their own, which are appended to the one of the image
+ * afterwards.  writers use it to write back only what changed, and --journal saves it as a
+ * diff that can also be undone. */
+
+struct journal_extent {
+	uint64_t off;
+	uint64_t len;
+	uint64_t data; // old bytes at bytes + data, new bytes right after them
+};
+
+struct patch_journal {
+	struct journal_extent *extents;
+	uint32_t num, max;
+	uint8_t *bytes;
+	uint64_t num_bytes, max_bytes;
+	boolean_t failed;
+};
+
+/* journal_add: records that the len bytes at off changed from old to new (to zeroes if new
+ * is NULL).  bytes that didn't change are left out at both ends. */
+
+static void journal_add(struct patch_journal *j, uint64_t off, uint64_t len,
+		const uint8_t *old, const uint8_t *new)
+{
+	struct journal_extent *extents, *e;
+	uint8_t *bytes;
+	uint64_t max;
+
+	while (len && (*old == (new ? *new : 0))) {
+		old++, off++, len--;
+		if (new)
+			new++;
+	}
+	while (len && (old[len - 1] == (new ? new[len - 1] : 0)))
+		len--;
+	if (!len || j->failed)
+		return;
+
+	if (j->num == j->max) {
+		max = j->max ? j->max * 2 : 64;
+		extents = realloc(j->extents, max * sizeof(struct journal_extent));
+		if (!extents) {
+			j->failed = TRUE;
+			return;
+		}
+		j->extents = extents;
+		j->max = max;
+	}
+	if (j->num_bytes + 2 * len > j->max_bytes) {
+		max = j->max_bytes ? j->max_bytes : 1024;
+		while (j->num_bytes + 2 * len > max)
+			max *= 2;
+		bytes = realloc(j->bytes, max);
+		if (!bytes) {
+			j->failed = TRUE;
+			return;
+		}
+		j->bytes = bytes;
+		j->max_bytes = max;
+	}
+
+	e = &j->extents[j->num++];
+	e->off = off;
+	e->len = len;
+	e->data = j->num_bytes;
+	memcpy(j->bytes + e->data, old, len);
+	if (new)
+		memcpy(j->bytes + e->data + len, new, len);
+	else
+		memset(j->bytes + e->data + len, 0, len);
+	j->num_bytes += 2 * len;
+}
+
+/* journal_append: appends the extents of src to dst, moving them by base */
+
+static void journal_append(struct patch_journal *dst, const struct patch_journal *src,
+		uint64_t base)
+{
+	const struct journal_extent *e;
+	uint32_t i;
+
+	if (src->failed)
+		dst->failed = TRUE;
+	for (i = 0; i < src->num; i++) {
+		e = &src->extents[i];
+		journal_add(dst, base + e->off, e->len, src->bytes + e->data,
+				src->bytes + e->data + e->len);
+	}
+}
+
+#ifndef INSN_PATCHER_NO_MAIN
+static int compare_extents(const void *a, const void *b)
+{
+	const struct journal_extent *x = a, *y = b;
+
+	if (x->off != y->off)
+		return (x->off < y->off) ? -1 : 1;
+	return (x->data < y->data) ? -1 : (x->data > y->data); // recording order
+}
+
+static int compare_recordings(const void *a, const void *b)
+{
+	const struct journal_extent *x = a, *y = b;
+
+	return (x->data < y->data) ? -1 : (x->data > y->data);
+}
+
+static void journal_sort(struct patch_journal *j)
+{
+	struct patch_journal merged;
+	struct journal_extent *e, first;
+	uint64_t end, len;
+	uint8_t *old, *new;
+	uint32_t i, k, n;
+
+	if (j->failed || (j->num < 2))
+		return;
+	qsort(j->extents, j->num, sizeof(struct journal_extent), compare_extents);
+	for (i = 1; i < j->num; i++)
+		if (j->extents[i].off <= j->extents[i - 1].off + j->extents[i - 1].len)
+			break;
+	if (i == j->num)
+		return; // nothing to merge
+
+	memset(&merged, 0, sizeof(merged));
+	for (i = 0; (i < j->num) && !merged.failed; i = n) {
+		first = j->extents[i];
+		end = first.off + first.len;
+		for (n = i + 1; (n < j->num) && (j->extents[n].off <= end); n++)
+			end = max(end, j->extents[n].off + j->extents[n].len);
+		len = end - first.off;
+		old = malloc(len);
+		new = malloc(len);
+		if (!old || !new) {
+			free(old);
+			free(new);
+			merged.failed = TRUE;
+			break;
+		}
+		/* the first recording of a byte has its oldest, the last one its newest value */
+		qsort(j->extents + i, n - i, sizeof(struct journal_extent), compare_recordings);
+		for (k = n; k-- > i; ) {
+			e = &j->extents[k];
+			memcpy(old + (e->off - first.off), j->bytes + e->data, e->len);
+		}
+		for (k = i; k < n; k++) {
+			e = &j->extents[k];
+			memcpy(new + (e->off - first.off), j->bytes + e->data + e->len, e->len);
+		}
+		journal_add(&merged, first.off, len, old, new);
+		free(old);
+		free(new);
+	}
+
+	free(j->extents);
+	free(j->bytes);
+	*j = merged;
+}
+#endif
+
+static void journal_free(struct patch_journal *j)
+{
+	free(j->extents);
+	free(j->bytes);
+	memset(j, 0, sizeof(struct patch_journal));
+}
+
+/* patch_site: patches the instruction at insn, at offset off of the image, and records the
+ * change in j (if not NULL) */
+
+static boolean_t patch_site(uint8_t *insn, uint64_t off, boolean_t verbose, boolean_t abi_is_64,
+		struct patch_journal *j)
+{
+	uint8_t old[3 + USER_RULE_MAX_LEN], *p = insn - 3; // a sysenter trap or a user rule
+
+	if (!j)
+		return patch_insn(insn, verbose, abi_is_64);
+	memcpy(old, p, sizeof(old));
+	if (!patch_insn(insn, verbose, abi_is_64))
+		return FALSE;
+	journal_add(j, off - 3, sizeof(old), old, p);
+	return TRUE;
+}
+
+/* scan_state carries what the sweep needs to decide whether an instruction may be patched:
+ * the offset of the last bad (or resting) instruction and the running counters.  with defer
+ * set, instructions that pass the checks are added to that list instead of being patched.
+ * with analysis set (--analyze) nothing is patched or deferred: all instructions needing a
+ * patch, STATUS_SKIPPED if they fail the checks, are added to that list.  map (if not NULL)
+ * receives the decode itself; the loops record into it, not scan_apply. */
+
+struct scan_state {
+	uint8_t *start;
+	boolean_t should_patch;
+	boolean_t abi_is_64;
+	boolean_t verbose;
+	boolean_t have_bad;
+	uint64_t last_bad;
+	uint32_t num_bad;
+	uint32_t num_patches;
+	struct scan_events *defer;
+	struct scan_events *analysis;
+	struct insn_map *map;
+	const struct data_ranges *ranges; // data to skip
+	struct patch_journal *journal; // records the patches if not NULL
+	uint64_t journal_off; // offset of start in the image
+};
+
+static inline void scan_apply(struct scan_state *st, uint64_t off, uint8_t status)
+{
+	if (status & STATUS_BAD) {
+		st->last_bad = off;
+		st->have_bad = TRUE;
+		st->num_bad++;
+		return;
+	}
+	if (status & STATUS_REST) {
+		st->last_bad = off;
+		st->have_bad = TRUE;
+	}
+	if (!(status & STATUS_NEEDS_PATCH) || !st->should_patch)
+		return;
+	if (st->analysis) {
+		if (st->have_bad && ((off - st->last_bad) <= REST_SIZE))
+			status |= STATUS_SKIPPED;
+		scan_events_add(st->analysis, off, status & (STATUS_NEEDS_PATCH|STATUS_SKIPPED));
+		return;
+	}
+	if (st->have_bad && ((off - st->last_bad) <= REST_SIZE))
+		return;
+	if (st->defer)
+		scan_events_add(st->defer, off, status);
+	else if (patch_site(st->start + off, st->journal_off + off, st->verbose, st->abi_is_64,
+				st->journal))
+		st->num_patches++;
+}
+
+/* chunked parallel sweep.  the section is cut into chunks and every chunk is decoded
+ * speculatively from its first byte, recording the instruction starts it visits and the
+ * events (bad, rest, needs-patch) it sees, without patching anything.  the merge then walks
+ * the chunks in order, following the real (serial) decode: as soon as the real decode lands
+ * on an instruction start the chunk also visited, both decodes are identical from there to
+ * the end of the chunk and the recorded events can be replayed.  x86 decoding
+ * resynchronizes within a few instructions, so the merge re-decodes very little.  patches
+ * are applied during the merge, in section order, which makes the result bit-identical to
+ * the serial sweep (patching never changes the length of the patched instruction or the
+ * bytes after it).  the chunks record their instruction starts in an instruction map (the
+ * one of the scan, or one of their own), in whole words of it; the merge clears what the
+ * speculative decodes got wrong, so the map ends up holding the real decode. */
+
+#define SCAN_CHUNK_MIN		(256 * 1024)
+#define SCAN_CHUNKS_PER_THREAD	4
+
+struct scan_chunk {
+	uint8_t *data; // section start
+	uint8_t *sect_end;
+	boolean_t abi_is_64;
+	uint64_t begin, end; // chunk boundaries (offsets into the section)
+	uint64_t exit; // first offset at or beyond end reached by the speculative decode
+	struct insn_map *map; // of the section
+	const struct data_ranges *ranges; // data to skip
+	struct scan_events ev;
+};
+
+static void scan_chunk(void *ctx, uint32_t index)
+{
+	struct scan_chunk *c = (struct scan_chunk *) ctx + index;
+	struct data_cursor dc;
+	uint64_t off;
+	uint32_t len;
+	uint8_t status;
+
+	data_seek(&dc, c->ranges, c->begin);
+	for (off = data_skip(&dc, c->begin); (off < c->end) && !c->ev.failed;
+			off = data_skip(&dc, off + len)) {
+		len = scan_step(c->data + off, c->sect_end, c->abi_is_64, &status);
+		map_record(c->map, off, status);
+		if (status & (STATUS_BAD|STATUS_NEEDS_PATCH|STATUS_REST))
+			scan_events_add(&c->ev, off, status);
+	}
+	c->exit = off;
+}
+
+static boolean_t scan_text_section_parallel(struct scan_state *st, uint64_t size)
+{
+	struct scan_chunk *chunks;
+	struct data_cursor dc;
+	struct insn_map own, *map = st->map;
+	uint64_t chunk_size, off;
+	uint32_t num_chunks, k, i;
+	uint8_t status;
+	boolean_t ok = TRUE;
+
+	num_chunks = min(size / SCAN_CHUNK_MIN, thread_limit() * SCAN_CHUNKS_PER_THREAD);
+	if (num_chunks < 2)
+		return FALSE;
+	chunk_size = ((size + num_chunks - 1) / num_chunks + 63) & ~63ULL; // whole map words
+
+	if (!map) {
+		if (!alloc_insn_map(&own, size))
+			return FALSE;
+		map = &own;
+	}
+	chunks = calloc(num_chunks, sizeof(struct scan_chunk));
+	if (!chunks) {
+		if (map == &own)
+			free_insn_map(&own);
+		return FALSE;
+	}
+	for (k = 0; k < num_chunks; k++) {
+		chunks[k].data = st->start;
+		chunks[k].sect_end = st->start + size;
+		chunks[k].abi_is_64 = st->abi_is_64;
+		chunks[k].begin = min(k * chunk_size, size);
+		chunks[k].end = min((k + 1) * chunk_size, size);
+		chunks[k].map = map;
+		chunks[k].ranges = st->ranges;
+	}
+
+	parallel_for(num_chunks, scan_chunk, chunks);
+	for (k = 0; k < num_chunks; k++)
+		if (chunks[k].ev.failed)
+			ok = FALSE;
+
+	data_seek(&dc, st->ranges, 0);
+	for (k = 0, off = data_skip(&dc, 0); ok && (k < num_chunks); k++) {
+		struct scan_chunk *c = &chunks[k];
+
+		/* the previous chunk's real decode covered the chunk up to off */
+		map_clear(map, c->begin, min(off, c->end));
+
+		/* follow the real decode until it meets the speculative one, replacing what the
+		 * speculative decode recorded on the way */
+		while ((off < c->end) && !map_test(map->starts, off)) {
+			uint32_t len = scan_step(st->start + off, st->start + size,
+					st->abi_is_64, &status);
+			scan_apply(st, off, status);
+			map_clear(map, off, min(off + len, c->end));
+			map_record(map, off, status);
+			off = data_skip(&dc, off + len);
+		}
+		if (off >= c->end)
+			continue;
+
+		for (i = 0; (i < c->ev.num) && (c->ev.events[i].off < off); i++)
+			;
+		for (; i < c->ev.num; i++)
+			scan_apply(st, c->ev.events[i].off, c->ev.events[i].status);
+		off = c->exit;
+		data_seek(&dc, st->ranges, off);
+	}
+
+	for (k = 0; k < num_chunks; k++)
+		free(chunks[k].ev.events);
+	free(chunks);
+	if (map == &own)
+		free_insn_map(&own);
+	else if (!ok)
+		map_clear(map, 0, size);
+
+	return ok;
+}
+
+/* candidate pre-filter: only a handful of byte patterns can ever be patched (see patch_insn):
+ * 0F A2 (CPUID), 0F 34 (SYSENTER, 32-bit only), F2 0F F0 (LDDQU) and DB/DD/DF with a modrm
+ * reg of 1 (FISTTP), each if its rule is selected.  next_patch_candidate finds the next
+ * offset where one of them starts, comparing 16 or 32 bytes at a time.  it may return a
+ * superset of the real candidates (e.g. D9 for the FISTTP escapes); the decoder decides.
+ * the loop is built once for every combination of the site rules (find_candidate with a
+ * constant rule set, see CANDIDATE_VARIANT), so it only compares what the selected rules
+ * need.  with user rules, one more variant also compares the first bytes they accept. */
+
+#define ALWAYS_INLINE		inline __attribute__((always_inline))
+
+static ALWAYS_INLINE boolean_t is_patch_candidate(uint8_t *p, boolean_t abi_is_64,
+		const uint32_t rules, const boolean_t user)
+{
+	if (user && user_first[p[0]])
+		return TRUE;
+	if ((rules & (RULE_CPUID|RULE_SYSENTER_TRAP)) && (p[0] == 0x0f) &&
+			(((rules & RULE_CPUID) && (p[1] == 0xa2)) ||
+			 ((rules & RULE_SYSENTER_TRAP) && !abi_is_64 && (p[1] == 0x34))))
+		return TRUE;
+	if ((rules & RULE_LDDQU) && (p[0] == 0xf2) && (p[1] == 0x0f) && (p[2] == 0xf0))
+		return TRUE;
+	if ((rules & RULE_FISTTP) && ((p[0] & 0xf9) == 0xd9) && ((p[1] & 0x38) == 0x08))
+		return TRUE;
+	return FALSE;
+}
+
+static ALWAYS_INLINE uint64_t find_candidate(uint8_t *start, uint64_t off, uint64_t size,
+		boolean_t abi_is_64, const uint32_t rules, const boolean_t user)
+{
+#ifdef CAND_VEC
+	cand_vec_t v0, v1, hit, zero;
+	uint32_t mask, n;
+
+	zero = cand_set1(0);
+	for (; off + CAND_VEC + 2 <= size; off += CAND_VEC) {
+		v0 = cand_load(start + off);
+		v1 = cand_load(start + off + 1);
+		hit = zero;
+		if (rules & RULE_CPUID)
+			hit = cand_eq(v1, cand_set1(0xa2));
+		if ((rules & RULE_SYSENTER_TRAP) && !abi_is_64)
+			hit = cand_or(hit, cand_eq(v1, cand_set1(0x34)));
+		if (rules & (RULE_CPUID|RULE_SYSENTER_TRAP))
+			hit = cand_and(hit, cand_eq(v0, cand_set1(0x0f)));
+		if (rules & RULE_LDDQU)
+			hit = cand_or(hit, cand_and(cand_and(cand_eq(v0, cand_set1(0xf2)),
+					cand_eq(v1, cand_set1(0x0f))),
+					cand_eq(cand_load(start + off + 2), cand_set1(0xf0))));
+		if (rules & RULE_FISTTP)
+			hit = cand_or(hit, cand_and(cand_eq(cand_and(v0, cand_set1(0xf9)),
+					cand_set1(0xd9)),
+					cand_eq(cand_and(v1, cand_set1(0x38)), cand_set1(0x08))));
+		for (n = 0; user && (n < num_user_first); n++)
+			hit = cand_or(hit, cand_eq(cand_and(v0, cand_set1(user_first_mask[n])),
+					cand_set1(user_first_value[n])));
+		mask = cand_mask(hit);
+		if (mask)
+			return off + __builtin_ctz(mask);
+	}
+#endif
+	/* scalar tail (the section is followed by at least 16 readable bytes, see
+	 * patch_text_segment) */
+	for (; off < size; off++)
+		if (is_patch_candidate(start + off, abi_is_64, rules, user))
+			return off;
+	return size;
+}
+
+#define CANDIDATE_VARIANT(rules)	\
+	case (rules): return find_candidate(start, off, size, abi_is_64, (rules), FALSE)
+
+static uint64_t next_patch_candidate(uint8_t *start, uint64_t off, uint64_t size,
+		boolean_t abi_is_64)
+{
+	if (num_user_rules)
+		return find_candidate(start, off, size, abi_is_64, patch_rules & RULES_SITES, TRUE);
+	switch (patch_rules & RULES_SITES) {
+	CANDIDATE_VARIANT(0);
+	CANDIDATE_VARIANT(1);
+	CANDIDATE_VARIANT(2);
+	CANDIDATE_VARIANT(3);
+	CANDIDATE_VARIANT(4);
+	CANDIDATE_VARIANT(5);
+	CANDIDATE_VARIANT(6);
+	CANDIDATE_VARIANT(7);
+	CANDIDATE_VARIANT(8);
+	CANDIDATE_VARIANT(9);
+	CANDIDATE_VARIANT(10);
+	CANDIDATE_VARIANT(11);
+	CANDIDATE_VARIANT(12);
+	CANDIDATE_VARIANT(13);
+	CANDIDATE_VARIANT(14);
+	default:
+		return find_candidate(start, off, size, abi_is_64, RULES_SITES, FALSE);
+	}
+}
+
+/* backward resynchronization: proves that an offset lies on the linear decode of the section
+ * without decoding everything in front of it.
+ *
+ * the linear decode has to have an instruction start somewhere in the window
+ * [a, a + RESYNC_WINDOW), unless one step of it covers the whole window: a run of padding
+ * (identical bytes) or an instruction longer than RESYNC_WINDOW, which is only possible if
+ * the first RESYNC_WINDOW - RESYNC_MAX_BODY bytes of the window are prefixes.  if the window
+ * is free of both, the decodes from all RESYNC_WINDOW offsets of the window are followed
+ * until they merge with the decode from a; the point where the last of them merges is then
+ * also on the linear decode.  if that point lies at least REST_SIZE bytes before the target,
+ * everything that can affect patching at the target (see scan_apply) is decoded from it. */
+
+#define RESYNC_WINDOW		32
+#define RESYNC_MAX_BODY		27	// longest instruction without its prefixes
+#define RESYNC_MIN_DIST		256
+#define RESYNC_MAX_DIST		16384
+
+static boolean_t resync_window_safe(uint8_t *p, boolean_t abi_is_64)
+{
+	uint32_t n, flags;
+
+	for (n = 1; n < RESYNC_WINDOW; n++)
+		if (p[n] != p[0])
+			break;
+	if (n == RESYNC_WINDOW)
+		return FALSE;
+
+	for (n = 0; n < RESYNC_WINDOW - RESYNC_MAX_BODY; n++) {
+		flags = one_byte_table[p[n]];
+		if (!abi_is_64)
+			flags &= ~OP_REX;
+		if (!(flags & (OP_PREFIX|OP_REX)))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* resync_anchor: finds an offset at or before target - REST_SIZE (and after from) that is
+ * provably an instruction start of the linear decode.  returns FALSE if none was found. */
+
+static boolean_t resync_anchor(uint8_t *start, uint64_t size, boolean_t abi_is_64,
+		uint64_t from, uint64_t target, uint64_t *anchor)
+{
+	uint8_t visited[RESYNC_MAX_DIST / 8];
+	uint64_t dist, a, limit, off, merge;
+	uint32_t n;
+	uint8_t status;
+
+	if (target < REST_SIZE)
+		return FALSE;
+	limit = target - REST_SIZE;
+
+	for (dist = RESYNC_MIN_DIST; dist <= RESYNC_MAX_DIST; dist *= 4) {
+		if ((dist > target) || (target - dist < from))
+			return FALSE;
+		a = target - dist;
+		if (!resync_window_safe(start + a, abi_is_64))
+			continue;
+
+		memset(visited, 0, (dist + 7) / 8);
+		for (off = a; off <= limit; off += scan_step(start + off, start + size,
+					abi_is_64, &status))
+			visited[(off - a) >> 3] |= 1 << ((off - a) & 7);
+
+		merge = a;
+		for (n = 1; n < RESYNC_WINDOW; n++) {
+			for (off = a + n; off <= limit; off += scan_step(start + off,
+						start + size, abi_is_64, &status))
+				if (visited[(off - a) >> 3] & (1 << ((off - a) & 7)))
+					break;
+			if (off > limit)
+				break;
+			if (off > merge)
+				merge = off;
+		}
+		if (n == RESYNC_WINDOW) {
+			*anchor = merge;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* candidate-driven sweep (--sparse): decodes only from a proven anchor up to each candidate
+ * found by next_patch_candidate, and linearly between candidates that are close together.
+ * patches are the same as with the full sweep; bad instructions are only counted where
+ * something was decoded.  the end of a data range is an anchor for free if nothing in front
+ * of it can affect the candidate: either it is at least REST_SIZE bytes away, or the range
+ * itself is (so any bad instruction before it is).  resync_anchor is only asked to search
+ * behind the last data range, where the decode has no jumps. */
+
+#define SPARSE_GAP		4096	// resynchronize only for candidates further away
+
+static void scan_text_section_sparse(struct scan_state *st, uint64_t size)
+{
+	const struct data_range *r;
+	struct data_cursor dc;
+	uint64_t off, pos, cand, anchor, from;
+	uint8_t status;
+	uint32_t len, j;
+
+	data_seek(&dc, st->ranges, 0);
+	off = pos = data_skip(&dc, 0);
+	while ((cand = next_patch_candidate(st->start, pos, size, st->abi_is_64)) < size) {
+		for (j = dc.next; (j < dc.num) && (dc.ranges[j].end <= cand); j++) {
+			r = &dc.ranges[j];
+			if ((r->end > off) && ((r->end + REST_SIZE <= cand) ||
+						(r->end - r->begin >= REST_SIZE))) {
+				off = r->end;
+				st->have_bad = FALSE;
+				dc.next = j + 1;
+			}
+		}
+		if ((j < dc.num) && (dc.ranges[j].begin <= cand)) {
+			/* the candidate is data and never decoded */
+			pos = dc.ranges[j].end;
+			continue;
+		}
+		if (cand - off > SPARSE_GAP) {
+			from = (j > dc.next) ? dc.ranges[j - 1].end : off;
+			if (resync_anchor(st->start, size, st->abi_is_64, from, cand, &anchor)) {
+				/* nothing before the anchor is within REST_SIZE of the candidate */
+				off = anchor;
+				st->have_bad = FALSE;
+				dc.next = j;
+			}
+		}
+		while (off <= cand) {
+			len = scan_step(st->start + off, st->start + size, st->abi_is_64, &status);
+			scan_apply(st, off, status);
+			off = data_skip(&dc, off + len);
+		}
+		pos = off;
+	}
+}
+
+/* scan_section: scan_text_section, recording the patches in journal (if not NULL) at offset
+ * journal_off of start.  with analysis set, nothing is patched; with map set, the section is
+ * decoded completely into it (see scan_state). */
+
+static uint32_t scan_section(uint8_t *start, uint64_t size, uint64_t text_addr,
+		const struct data_ranges *data, boolean_t should_patch, boolean_t abi_is_64,
+		boolean_t verbose, struct patch_journal *journal, uint64_t journal_off,
+		struct scan_events *analysis, struct insn_map *map, uint32_t *num_patches_out)
+{
+	int32_t res;
+	uint8_t *insn, *end, *last_bad;
+	uint32_t num_bad, num_patches;
+	struct scan_state st = { start, should_patch, abi_is_64, verbose, FALSE, 0, 0, 0, NULL,
+			analysis, map, data, journal, journal_off };
+	struct data_cursor dc;
+
+	insn = start;
+	end = start + size;
+	last_bad = NULL;
+	num_bad = 0;
+	num_patches = 0;
+
+	data_seek(&dc, data, 0);
+
+	if (verbose && !analysis && !map) {
+		uint64_t addr = text_addr;
+		uint32_t n;
+
+		for (res = 0; insn < end; insn += res, addr += res) {
+			uint8_t status = 0;
+			if ((dc.next < dc.num) && ((uint64_t) (insn - start) >= dc.ranges[dc.next].begin)) {
+				/* the last step may have ended inside a range or beyond it */
+				uint64_t off = insn - start, skip = off;
+
+				for (; (dc.next < dc.num) && (skip >= dc.ranges[dc.next].begin); dc.next++) {
+					const struct data_range *r = &dc.ranges[dc.next];
+					if (r->end <= skip)
+						continue;
+					printf("%08llx: (%llu bytes data)\n",
+							(unsigned long long) (text_addr + r->begin),
+							(unsigned long long) (r->end - r->begin));
+					skip = r->end;
+				}
+				if (skip > off) {
+					res = (int32_t) (skip - off);
+					continue;
+				}
+			}
+			res = get_insn_length(insn, abi_is_64, &status);
+			if ((res > 0) && (status & STATUS_PADDING)) {
+				n = fill_run(insn, end);
+				printf("%08llx: (%d bytes padding)\n", (unsigned long long) addr, n);
+				res = n;
+				continue;
+			}
+			if ((res > 0) && !status && is_long_nop(insn)) {
+				/* consecutive NOPs are listed as one run of padding */
+				for (n = res; (insn + n < end) && is_long_nop(insn + n); n += res) {
+					res = get_insn_length(insn + n, abi_is_64, &status);
+					if (res <= 0)
+						break;
+				}
+				printf("%08llx: (%d bytes padding)\n", (unsigned long long) addr, n);
+				res = n;
+				continue;
+			}
+			if ((res > 0) && user_rule_at(insn, end, (uint32_t) res))
+				status |= STATUS_NEEDS_PATCH;
+			if (res == INSN_INVALID) {
+				printf("%08llx: (bad)\n", (unsigned long long) addr);
+				res = 1;
+				last_bad = insn;
+				num_bad++;
+			} else if (res == INSN_UNSUPPORTED) {
+				printf("%08llx: (unsupported)\n", (unsigned long long) addr);
+				res = 1;
+				last_bad = insn;
+				num_bad++;
+			} else if (status) {
+				if (status & STATUS_REST) {
+					last_bad = insn;
+					printf("%08llx: (will rest)\n", (unsigned long long) addr);
+				}
+				if (!(status & STATUS_NEEDS_PATCH))
+					continue;
+				printf("%08llx: ", (unsigned long long) addr);
+				if (!should_patch || ((insn - last_bad) <= REST_SIZE)) {
+					printf("(skipped patch)\n");
+					continue;
+				}
+				if (!patch_site(insn, journal_off + (insn - start), verbose, abi_is_64,
+							journal))
+					printf("(unrecognized patch)\n");
+				else
+					num_patches++;
+			}
+		}
+	} else if (sparse_scan && should_patch && !analysis && !map) {
+		scan_text_section_sparse(&st, size);
+		num_bad = st.num_bad;
+		num_patches = st.num_patches;
+	} else if (scan_text_section_parallel(&st, size)) {
+		num_bad = st.num_bad;
+		num_patches = st.num_patches;
+	} else {
+		uint64_t off;
+		uint8_t status;
+
+		for (off = data_skip(&dc, 0); off < size; off = data_skip(&dc, off + res)) {
+			res = scan_step(start + off, end, abi_is_64, &status);
+			scan_apply(&st, off, status);
+			if (map)
+				map_record(map, off, status);
+		}
+		num_bad = st.num_bad;
+		num_patches = st.num_patches;
+	}
+
+	*num_patches_out = num_patches;
+
+	return num_bad;
+}
+
+uint32_t scan_text_section(uint8_t *start, uint64_t size, uint64_t text_addr,
+		const struct data_ranges *data, boolean_t should_patch, boolean_t abi_is_64,
+		boolean_t verbose, uint32_t *num_patches_out)
+{
+	return scan_section(start, size, text_addr, data, should_patch, abi_is_64, verbose, NULL,
+			0, NULL, NULL, num_patches_out);
+}
+
+boolean_t map_insn_boundaries(uint8_t *start, uint64_t size, const struct data_ranges *data,
+		boolean_t abi_is_64, struct insn_map *map)
+{
+	uint32_t num_patches;
+
+	if (!alloc_insn_map(map, size))
+		return FALSE;
+	scan_section(start, size, 0, data, FALSE, abi_is_64, FALSE, NULL, 0, NULL, map,
+			&num_patches);
+	return TRUE;
+}
+
+/* segment loading routines (for patching). */
+
+#define DEFINE_GETSEG(x)									\
+\
+struct segment_command##x *getsegforpatch##x(struct mach_header##x *header,		\
+const char *seg_name)								\
+{												\
+struct segment_command##x *sgp;								\
+uint32_t i;										\
+\
+sgp = (struct segment_command##x *) ((char *) header + sizeof (struct mach_header##x));	\
+for (i = 0; i < header->ncmds; i++) {							\
+if (sgp->cmd == LC_SEGMENT##x && !strncmp(sgp->segname, seg_name,		\
+sizeof (sgp->segname)))						\
+return sgp;								\
+sgp = (struct segment_command##x *) ((char *) sgp + sgp->cmdsize);		\
+}											\
+\
+return NULL;										\
+}
+
+DEFINE_GETSEG()
+DEFINE_GETSEG(_64)
+
+#define DEFINE_GETSECT(x)									\
+\
+struct section##x *getsectforpatch##x(struct mach_header##x *header,			\
+const char *segname, const char *sectname)					\
+{												\
 struct segment_command##x *sgp;								\
 struct section##x *sp;									\
 uint32_t i;										\
@@ -1397,440 +2783,3455 @@ sp = (struct section##x *) ((char *) sp + sizeof (struct section##x));		\
 return NULL;										\
 }
 
-DEFINE_GETSECT()
-DEFINE_GETSECT(_64)
+DEFINE_GETSECT()
+DEFINE_GETSECT(_64)
+
+/* macho_image: an index of the load commands of one (thin) image, built in a single pass.
+ * the passes over an image (code sections, function starts, data in code, code signature
+ * removal) look things up here instead of walking the load commands again.  damaged load
+ * commands end the walk; whatever was found up to there is kept. */
+
+struct macho_section {
+	char segname[16];
+	char sectname[16];
+	uint64_t addr, size;
+	uint32_t offset;
+	uint32_t flags;
+	uint32_t ordinal; // 1-based over all sections of the image, as nlist.n_sect
+};
+
+struct macho_segment {
+	char segname[16];
+	uint64_t vmaddr, vmsize;
+	uint64_t fileoff, filesize;
+	struct load_command *lc;
+	uint32_t first_section, num_sections; // in macho_image.sections
+};
+
+/* patch marker: an LC_NOTE command (note_command in newer SDKs) without data, owned by
+ * MARKER_OWNER and the patcher variant, that the tool leaves in the images it processed */
+
+#ifndef LC_NOTE
+#define LC_NOTE			0x31
+#endif
+
+#define MARKER_OWNER		"insn_patcher."
+
+struct patch_marker {
+	uint32_t cmd;
+	uint32_t cmdsize;
+	char data_owner[16];
+	uint64_t offset;
+	uint64_t size;
+};
+
+/* image_analysis: with --analyze, patch_image patches nothing but hands back, for every code
+ * section (in the order of the patch report), what its complete scan found: the instructions
+ * needing a patch (see scan_state) and the instruction map of the section (empty if it was
+ * bypassed). */
+
+struct section_analysis {
+	const struct macho_section *sect;
+	struct scan_events events;
+	struct insn_map map;
+};
+
+struct image_analysis {
+	struct section_analysis *sections;
+	uint32_t num_sections;
+};
+
+struct macho_image {
+	uint8_t *base;
+	mach_vm_size_t size;
+	boolean_t is_64;
+	struct macho_segment *segments;
+	uint32_t num_segments;
+	struct macho_section *sections;
+	uint32_t num_sections;
+	uint64_t text_vmaddr;
+	struct linkedit_data_command *code_signature;
+	struct linkedit_data_command *drs;
+	struct linkedit_data_command *function_starts;
+	struct linkedit_data_command *data_in_code;
+	struct symtab_command *symtab;
+	struct patch_marker *marker;
+	int fd; // streaming: only the load commands are in memory, the rest is read from fd
+	uint64_t fileoff; // streaming: offset of the image in fd
+	uint64_t loaded; // streaming: bytes at base (the header and the load commands)
+	boolean_t io_error; // streaming: reading or writing fd failed
+	boolean_t read_error; // streaming: reading fd failed (set by any job, see macho_read)
+	struct image_output *output; // streaming: if not NULL, fd is the input and writes go here
+	struct patch_journal *journal; // records the changes to the image if not NULL
+	struct image_analysis *analysis; // --analyze: receives what the scan finds, see patch_image
+};
+
+static boolean_t macho_add_segment(struct macho_image *img, struct load_command *lc,
+		const char *segname, uint64_t vmaddr, uint64_t vmsize, uint64_t fileoff,
+		uint64_t filesize, uint32_t nsects)
+{
+	struct macho_segment *tmp, *seg;
+	struct macho_section *sects;
+
+	tmp = realloc(img->segments, (img->num_segments + 1) * sizeof(struct macho_segment));
+	if (!tmp)
+		return FALSE;
+	img->segments = tmp;
+	seg = &tmp[img->num_segments++];
+	memcpy(seg->segname, segname, sizeof(seg->segname));
+	seg->vmaddr = vmaddr;
+	seg->vmsize = vmsize;
+	seg->fileoff = fileoff;
+	seg->filesize = filesize;
+	seg->lc = lc;
+	seg->first_section = img->num_sections;
+	seg->num_sections = nsects;
+	if (!strncmp(segname, "__TEXT", sizeof(seg->segname)))
+		img->text_vmaddr = vmaddr;
+
+	if (!nsects)
+		return TRUE;
+	sects = realloc(img->sections, (img->num_sections + nsects) * sizeof(struct macho_section));
+	if (!sects)
+		return FALSE;
+	img->sections = sects;
+	return TRUE;
+}
+
+static void macho_add_section(struct macho_image *img, const char *segname,
+		const char *sectname, uint64_t addr, uint64_t size, uint32_t offset, uint32_t flags)
+{
+	struct macho_section *sect = &img->sections[img->num_sections++];
+
+	memcpy(sect->segname, segname, sizeof(sect->segname));
+	memcpy(sect->sectname, sectname, sizeof(sect->sectname));
+	sect->addr = addr;
+	sect->size = size;
+	sect->offset = offset;
+	sect->flags = flags;
+	sect->ordinal = img->num_sections;
+}
+
+/* the 32 and 64-bit flavours of the load commands and symbol tables differ only in the width
+ * of some fields.  the code reading them is generated for both from one definition (like
+ * DEFINE_GETSEG above), and which one to use is decided once per image, not per field. */
+
+#define DEFINE_MACHO_INDEX_SEGMENT(x)							\
+\
+static int macho_index_segment##x(struct macho_image *img, struct load_command *lc)	\
+{											\
+	struct segment_command##x *sgp = (struct segment_command##x *) lc;		\
+	struct section##x *sp = (struct section##x *) (sgp + 1);			\
+	uint32_t n;									\
+\
+	if (lc->cmdsize < sizeof(*sgp))							\
+		return 0;								\
+	if (sizeof(*sgp) + (uint64_t) sgp->nsects * sizeof(*sp) > lc->cmdsize)		\
+		return 0;								\
+	if (!macho_add_segment(img, lc, sgp->segname, sgp->vmaddr, sgp->vmsize,		\
+				sgp->fileoff, sgp->filesize, sgp->nsects))		\
+		return -1;								\
+	for (n = 0; n < sgp->nsects; n++, sp++)						\
+		macho_add_section(img, sp->segname, sp->sectname, sp->addr, sp->size,	\
+				sp->offset, sp->flags);					\
+	return 1;									\
+}
+
+DEFINE_MACHO_INDEX_SEGMENT()
+DEFINE_MACHO_INDEX_SEGMENT(_64)
+
+/* macho_image_init: indexes the image at base (size bytes are mapped).  returns FALSE only
+ * if out of memory. */
+
+static boolean_t macho_image_init(struct macho_image *img, uint8_t *base, mach_vm_size_t size,
+		boolean_t is_64)
+{
+	int (*index_segment)(struct macho_image *, struct load_command *);
+	struct load_command *lc;
+	uint32_t ncmds, i, segment_cmd;
+	uint64_t off;
+	int res;
+
+	memset(img, 0, sizeof(struct macho_image));
+	img->base = base;
+	img->size = size;
+	img->is_64 = is_64;
+	img->fd = -1;
+
+	if (is_64) {
+		off = sizeof(struct mach_header_64);
+		segment_cmd = LC_SEGMENT_64;
+		index_segment = macho_index_segment_64;
+	} else {
+		off = sizeof(struct mach_header);
+		segment_cmd = LC_SEGMENT;
+		index_segment = macho_index_segment;
+	}
+	if (off > size)
+		return TRUE;
+
+	ncmds = ((struct mach_header *) base)->ncmds;
+	for (i = 0; i < ncmds; i++, off += lc->cmdsize) {
+		if (off + sizeof(struct load_command) > size)
+			break;
+		lc = (struct load_command *) (base + off);
+		if ((lc->cmdsize < sizeof(struct load_command)) || (off + lc->cmdsize > size))
+			break;
+
+		if (lc->cmd == segment_cmd) {
+			res = index_segment(img, lc);
+			if (res < 0)
+				return FALSE;
+			if (!res)
+				break;
+		} else if (lc->cmd == LC_CODE_SIGNATURE) {
+			img->code_signature = (struct linkedit_data_command *) lc;
+		} else if (lc->cmd == LC_DYLIB_CODE_SIGN_DRS) {
+			img->drs = (struct linkedit_data_command *) lc;
+		} else if (lc->cmd == LC_FUNCTION_STARTS) {
+			img->function_starts = (struct linkedit_data_command *) lc;
+		} else if (lc->cmd == LC_DATA_IN_CODE) {
+			img->data_in_code = (struct linkedit_data_command *) lc;
+		} else if (lc->cmd == LC_SYMTAB) {
+			img->symtab = (struct symtab_command *) lc;
+		} else if ((lc->cmd == LC_NOTE) && (lc->cmdsize >= sizeof(struct patch_marker)) &&
+				!strncmp(((struct patch_marker *) lc)->data_owner, MARKER_OWNER,
+					strlen(MARKER_OWNER))) {
+			img->marker = (struct patch_marker *) lc;
+		}
+	}
+	return TRUE;
+}
+
+static void macho_image_free(struct macho_image *img)
+{
+	free(img->segments);
+	free(img->sections);
+	img->segments = NULL;
+	img->sections = NULL;
+	img->num_segments = img->num_sections = 0;
+}
+
+/* output files: the output is only created once there is something to write to it, as a
+ * clone of the input that then gets the changes, so only what the patcher changed is ever
+ * written.  on file systems with shared extents (btrfs, XFS) the clone copies no data at
+ * all; elsewhere the kernel copies it without passing it through user space.  a mapped
+ * file is patched in a private mapping and its changes are written once it is done (see
+ * write_changes); a streamed image writes through an image_output, which creates the
+ * output on the first write. */
+
+#define COPY_BUFFER		(1024 * 1024)
+
+/* copy_file_data: copies the first size bytes of in to out */
+
+static int copy_file_data(int in, int out, uint64_t size)
+{
+	uint64_t off = 0;
+	uint8_t *buf;
+	ssize_t res, n, w = 0;
+
+#ifdef __linux__
+	loff_t in_off = 0, out_off = 0;
+
+	while (off < size) {
+		res = copy_file_range(in, &in_off, out, &out_off, size - off, 0);
+		if (res <= 0)
+			break;
+		off += res;
+	}
+	if ((off < size) && (lseek(out, off, SEEK_SET) == (off_t) off)) {
+		/* no copy_file_range across file systems on older kernels */
+		off_t sf_off = off;
+
+		while (off < size) {
+			res = sendfile(out, in, &sf_off, min(size - off, 0x40000000));
+			if (res <= 0)
+				break;
+			off += res;
+		}
+	}
+#endif
+
+	if (off == size)
+		return 0;
+	buf = malloc(COPY_BUFFER);
+	if (!buf)
+		return -1;
+	while (off < size) {
+		res = pread(in, buf, min(size - off, COPY_BUFFER), off);
+		if (res <= 0)
+			break;
+		for (n = 0; n < res; n += w) {
+			w = pwrite(out, buf + n, res - n, off + n);
+			if (w <= 0)
+				break;
+		}
+		if (n < res)
+			break;
+		off += res;
+	}
+	free(buf);
+	return (off == size) ? 0 : -1;
+}
+
+/* create_output: creates outfile as a copy of the first size bytes of in and returns a
+ * descriptor for reading and writing it, or -1.  outfile must not be in itself (that takes
+ * --in-place): truncating it would destroy the input. */
+
+static int create_output(int in, const char *outfile, uint64_t size)
+{
+	struct stat in_st, out_st;
+	int fd;
+
+	if ((fstat(in, &in_st) == 0) && (stat(outfile, &out_st) == 0) &&
+			(in_st.st_dev == out_st.st_dev) && (in_st.st_ino == out_st.st_ino))
+		return -1;
+	fd = open(outfile, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+#ifdef FICLONE
+	if (ioctl(fd, FICLONE, in) == 0)
+		return fd;
+#endif
+	if (copy_file_data(in, fd, size) != 0) {
+		close(fd);
+		unlink(outfile);
+		return -1;
+	}
+	return fd;
+}
+
+/* image_output: the output of the streamed images of one file.  until the first change the
+ * images read from in; that change creates the output, and from then on they read and write
+ * it.  with discard set nothing is created or written (the changes are only journaled). */
+
+struct image_output {
+	pthread_mutex_t lock;
+	int in;
+	const char *path;
+	uint64_t size;
+	int fd; // -1 until created
+	boolean_t failed;
+	boolean_t discard;
+};
+
+static int image_output_fd(struct image_output *out)
+{
+	int fd;
+
+	pthread_mutex_lock(&out->lock);
+	if ((out->fd < 0) && !out->failed) {
+		fd = create_output(out->in, out->path, out->size);
+		if (fd < 0)
+			out->failed = TRUE;
+		__atomic_store_n(&out->fd, fd, __ATOMIC_RELEASE);
+	}
+	fd = out->fd;
+	pthread_mutex_unlock(&out->lock);
+	return fd;
+}
+
+/* macho_read: copies size bytes at offset off of the image to buf.  a failed read of a
+ * streamed image is noted in img->read_error. */
+
+static boolean_t macho_read(struct macho_image *img, uint64_t off, uint64_t size, void *buf)
+{
+	uint8_t *p = buf;
+	ssize_t res;
+	int fd = img->fd;
+
+	if (off + size > img->size)
+		return FALSE;
+	if (img->fd < 0) {
+		memcpy(buf, img->base + off, size);
+		return TRUE;
+	}
+	if (img->output && (__atomic_load_n(&img->output->fd, __ATOMIC_ACQUIRE) >= 0))
+		fd = img->output->fd;
+	while (size > 0) {
+		res = pread(fd, p, size, img->fileoff + off);
+		if (res <= 0) {
+			__atomic_store_n(&img->read_error, TRUE, __ATOMIC_RELAXED);
+			return FALSE;
+		}
+		p += res;
+		off += res;
+		size -= res;
+	}
+	return TRUE;
+}
+
+/* macho_store: copies size bytes from buf to offset off of the image.  a streamed image is
+ * written through, and its loaded part is kept up to date. */
+
+static boolean_t macho_store(struct macho_image *img, uint64_t off, uint64_t size,
+		const void *buf)
+{
+	const uint8_t *p = buf;
+	ssize_t res;
+	int fd = img->fd;
+
+	if (off + size > img->size)
+		return FALSE;
+	if (img->fd < 0) {
+		memmove(img->base + off, buf, size);
+		return TRUE;
+	}
+	if (off < img->loaded)
+		memmove(img->base + off, buf, min(size, img->loaded - off));
+	if (img->output && img->output->discard)
+		return TRUE;
+	if (img->output && ((fd = image_output_fd(img->output)) < 0))
+		return FALSE;
+	while (size > 0) {
+		res = pwrite(fd, p, size, img->fileoff + off);
+		if (res <= 0)
+			return FALSE;
+		p += res;
+		off += res;
+		size -= res;
+	}
+	return TRUE;
+}
+
+/* macho_write: changes size bytes at offset off of the image to buf (or to zeroes if buf is
+ * NULL) and records the change in the journal of the image.  every change the patcher
+ * makes to an image other than patching an instruction (see patch_site) goes through here;
+ * a failure is noted in img->io_error. */
+
+static boolean_t macho_write(struct macho_image *img, uint64_t off, uint64_t size,
+		const void *buf)
+{
+	static const uint8_t zeros[4096];
+	uint8_t *old = NULL;
+	uint64_t len, n;
+	boolean_t ok = TRUE;
+
+	if (off + size > img->size)
+		return FALSE;
+	if (img->journal) {
+		old = malloc(size ? size : 1);
+		if (!old || !macho_read(img, off, size, old)) {
+			free(old);
+			img->journal->failed = TRUE;
+			old = NULL;
+		}
+	}
+
+	if (buf)
+		ok = macho_store(img, off, size, buf);
+	else if (img->fd < 0)
+		memset(img->base + off, 0, size);
+	else {
+		for (n = 0; ok && (n < size); n += len) {
+			len = min(size - n, sizeof(zeros));
+			ok = macho_store(img, off + n, len, zeros);
+		}
+	}
+
+	if (!ok)
+		img->io_error = TRUE;
+	else if (old)
+		journal_add(img->journal, off, size, old, buf);
+	free(old);
+	return ok;
+}
+
+/* macho_blob: returns the linkedit data of lc, or NULL if lc is NULL or its data lies
+ * outside of the image.  when streaming, the data is read into a new buffer; either way,
+ * release it with macho_blob_free. */
+
+static uint8_t *macho_blob(struct macho_image *img, struct linkedit_data_command *lc)
+{
+	uint8_t *blob;
+
+	if (!lc || ((uint64_t) lc->dataoff + lc->datasize > img->size))
+		return NULL;
+	if (img->fd < 0)
+		return img->base + lc->dataoff;
+	blob = malloc(lc->datasize ? lc->datasize : 1);
+	if (blob && !macho_read(img, lc->dataoff, lc->datasize, blob)) {
+		free(blob);
+		blob = NULL;
+	}
+	return blob;
+}
+
+static void macho_blob_free(struct macho_image *img, uint8_t *blob)
+{
+	if (img->fd >= 0)
+		free(blob);
+}
+
+/* code sections: every section flagged as containing instructions is scanned, not just
+ * __TEXT,__text: stubs, stub helpers, __TEXT_EXEC in kexts and so on. */
+
+static boolean_t is_code_section(const struct macho_section *sect)
+{
+	uint32_t type = sect->flags & SECTION_TYPE;
+
+	if (!(sect->flags & (S_ATTR_PURE_INSTRUCTIONS|S_ATTR_SOME_INSTRUCTIONS)))
+		return FALSE;
+	if ((type == S_ZEROFILL) || (type == S_GB_ZEROFILL) || (type == S_THREAD_LOCAL_ZEROFILL))
+		return FALSE;
+	return (sect->offset != 0) && (sect->size != 0);
+}
+
+/* function starts: LC_FUNCTION_STARTS (or, failing that, the symbols of LC_SYMTAB that are
+ * defined in the text section) give exact entry points.  every function is then decoded on
+ * its own, from its first byte up to the next function, so the decoder can't drift across
+ * jump tables or other data between functions, and the functions can be decoded in
+ * parallel. */
+
+static int compare_offsets(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/* start_list is a growable list of function start offsets */
+
+struct start_list {
+	uint64_t *starts;
+	uint32_t num, max;
+	boolean_t failed;
+};
+
+static void start_list_add(struct start_list *list, uint64_t off)
+{
+	uint64_t *starts;
+
+	if (list->num == list->max) {
+		list->max = list->max ? list->max * 2 : 1024;
+		starts = realloc(list->starts, list->max * sizeof(uint64_t));
+		if (!starts) {
+			list->failed = TRUE;
+			return;
+		}
+		list->starts = starts;
+	}
+	list->starts[list->num++] = off;
+}
+
+/* symbol_starts: adds the symbols of LC_SYMTAB defined in sect to the list.  the symbols
+ * are read SYMBOL_BATCH at a time, so a streamed image needs no room for the whole table. */
+
+#define SYMBOL_BATCH		1024
+
+#define DEFINE_SYMBOL_STARTS(x)								\
+\
+static void symbol_starts##x(struct macho_image *img, const struct macho_section *sect,	\
+		struct start_list *list)						\
+{											\
+	struct symtab_command *symtab = img->symtab;					\
+	struct nlist##x batch[SYMBOL_BATCH], *nl;					\
+	uint32_t i, n, num;								\
+\
+	if ((uint64_t) symtab->symoff +							\
+			(uint64_t) symtab->nsyms * sizeof(*nl) > img->size)		\
+		return;									\
+	for (i = 0; i < symtab->nsyms; i += num) {					\
+		num = min(symtab->nsyms - i, SYMBOL_BATCH);				\
+		if (!macho_read(img, symtab->symoff + (uint64_t) i * sizeof(*nl),	\
+					num * sizeof(*nl), batch))			\
+			return;								\
+		for (n = 0, nl = batch; n < num; n++, nl++) {				\
+			if ((nl->n_type & N_STAB) || ((nl->n_type & N_TYPE) != N_SECT) ||	\
+					(nl->n_sect != sect->ordinal))			\
+				continue;						\
+			if ((nl->n_value > sect->addr) &&				\
+					(nl->n_value < sect->addr + sect->size))	\
+				start_list_add(list, nl->n_value - sect->addr);		\
+		}									\
+	}										\
+}
+
+DEFINE_SYMBOL_STARTS()
+DEFINE_SYMBOL_STARTS(_64)
+
+/* collect_function_starts: returns the number of function starts found in the code section
+ * sect and a sorted, duplicate-free array of their offsets into the section in *starts_out.
+ * the first entry is always 0.  returns 0 if the image has neither LC_FUNCTION_STARTS nor
+ * usable symbols. */
+
+static uint32_t collect_function_starts(struct macho_image *img,
+		const struct macho_section *sect, uint64_t **starts_out)
+{
+	struct start_list list = { NULL, 0, 0, FALSE };
+	uint8_t *fstarts = macho_blob(img, img->function_starts);
+	uint32_t i, n;
+	uint64_t a;
+
+	start_list_add(&list, 0);
+
+	if (fstarts) {
+		uint8_t *p = fstarts;
+		uint8_t *end = p + img->function_starts->datasize;
+		uint64_t delta;
+		uint32_t shift;
+
+		a = img->text_vmaddr;
+		while (p < end) {
+			delta = 0;
+			shift = 0;
+			do {
+				delta |= (uint64_t) (*p & 0x7f) << shift;
+				shift += 7;
+			} while ((*p++ & 0x80) && (p < end) && (shift < 64));
+			if (!delta)
+				break;
+			a += delta;
+			if ((a > sect->addr) && (a < sect->addr + sect->size))
+				start_list_add(&list, a - sect->addr);
+		}
+		macho_blob_free(img, fstarts);
+	} else if (img->symtab) {
+		if (img->is_64)
+			symbol_starts_64(img, sect, &list);
+		else
+			symbol_starts(img, sect, &list);
+	}
+
+	if (list.failed || (list.num <= 1)) {
+		free(list.starts);
+		return 0;
+	}
+
+	qsort(list.starts, list.num, sizeof(uint64_t), compare_offsets);
+	for (i = 1, n = 1; i < list.num; i++)
+		if (list.starts[i] != list.starts[n - 1])
+			list.starts[n++] = list.starts[i];
+
+	*starts_out = list.starts;
+	return n;
+}
+
+/* data in code: LC_DATA_IN_CODE lists the jump tables and constants the compiler placed in
+ * the middle of the code.  decoding them only produces bad instructions (and can trip the
+ * prescan), so the scanner skips them. */
+
+static int compare_ranges(const void *a, const void *b)
+{
+	const struct data_range *x = a, *y = b;
+
+	return (x->begin < y->begin) ? -1 : (x->begin > y->begin);
+}
+
+/* collect_data_in_code: fills *data with the data ranges that lie in the code section sect,
+ * as offsets into the section, sorted and merged.  size is the part of the section that is
+ * scanned.  returns FALSE if there are none. */
+
+static boolean_t collect_data_in_code(struct macho_image *img, const struct macho_section *sect,
+		uint64_t size, struct data_ranges *data)
+{
+	struct data_in_code_entry *entries, *entry;
+	struct data_range *ranges;
+	uint64_t begin, end, text_offset = sect->offset;
+	uint32_t i, n, num;
+
+	data->ranges = NULL;
+	data->num = 0;
+
+	entries = (struct data_in_code_entry *) macho_blob(img, img->data_in_code);
+	if (!entries)
+		return FALSE;
+
+	num = img->data_in_code->datasize / sizeof(struct data_in_code_entry);
+	ranges = num ? malloc(num * sizeof(struct data_range)) : NULL;
+	if (!ranges) {
+		macho_blob_free(img, (uint8_t *) entries);
+		return FALSE;
+	}
+
+	/* entry offsets are relative to the mach header */
+	for (i = 0, n = 0, entry = entries; i < num; i++, entry++) {
+		begin = entry->offset;
+		end = begin + entry->length;
+		if (!entry->length || (end <= text_offset) || (begin >= text_offset + size))
+			continue;
+		ranges[n].begin = (begin > text_offset) ? begin - text_offset : 0;
+		ranges[n].end = min(end - text_offset, size);
+		n++;
+	}
+	macho_blob_free(img, (uint8_t *) entries);
+	if (!n) {
+		free(ranges);
+		return FALSE;
+	}
+
+	qsort(ranges, n, sizeof(struct data_range), compare_ranges);
+	for (i = 1, num = 1; i < n; i++) {
+		if (ranges[i].begin <= ranges[num - 1].end) {
+			if (ranges[i].end > ranges[num - 1].end)
+				ranges[num - 1].end = ranges[i].end;
+		} else
+			ranges[num++] = ranges[i];
+	}
+
+	data->ranges = ranges;
+	data->num = num;
+	return TRUE;
+}
+
+/* decoding by function: functions are handed out in contiguous groups; every group records
+ * the instructions it would patch, and the patches are applied afterwards in section order
+ * (patch_insn looks at the bytes in front of a sysenter, which may belong to the previous
+ * function). */
+
+#define FUNCS_PER_THREAD	16
+
+struct func_job {
+	uint8_t *text;
+	uint64_t text_size;
+	boolean_t abi_is_64;
+	uint64_t *starts;
+	uint32_t num_starts;
+	const struct data_ranges *ranges;
+	uint32_t first, last; // functions [first, last)
+	uint32_t num_bad;
+	struct scan_events sites;
+	boolean_t analyze;
+	struct scan_events analysis; // if analyze
+	struct insn_map *map; // of the section, if not NULL
+};
+
+static void scan_function_group(void *ctx, uint32_t index)
+{
+	struct func_job *job = (struct func_job *) ctx + index;
+	struct data_cursor dc;
+	struct scan_state st;
+	uint64_t off, end;
+	uint32_t f, len;
+	uint8_t status;
+
+	for (f = job->first; f < job->last; f++) {
+		off = job->starts[f];
+		end = (f + 1 < job->num_starts) ? job->starts[f + 1] : job->text_size;
+		if (sparse_scan && !job->analyze && !job->map &&
+				(next_patch_candidate(job->text, off, end, job->abi_is_64) == end))
+			continue;
+
+		memset(&st, 0, sizeof(st));
+		st.start = job->text;
+		st.should_patch = TRUE;
+		st.abi_is_64 = job->abi_is_64;
+		st.defer = &job->sites;
+		st.analysis = job->analyze ? &job->analysis : NULL;
+		data_seek(&dc, job->ranges, off);
+		for (off = data_skip(&dc, off); off < end; off = data_skip(&dc, off + len)) {
+			len = scan_step(job->text + off, job->text + end, job->abi_is_64, &status);
+			scan_apply(&st, off, status);
+			if (job->map)
+				map_record_shared(job->map, off, status);
+		}
+		job->num_bad += st.num_bad;
+	}
+}
+
+static boolean_t scan_functions(uint8_t *text, uint64_t text_size, boolean_t abi_is_64,
+		uint64_t *starts, uint32_t num_starts, const struct data_ranges *ranges,
+		struct patch_journal *journal, uint64_t journal_off, struct scan_events *analysis,
+		struct insn_map *map, uint32_t *num_patches_out, uint32_t *num_bad_out)
+{
+	struct func_job *jobs;
+	uint32_t num_jobs, k, i, num_patches = 0, num_bad = 0;
+	boolean_t ok = TRUE;
+
+	num_jobs = min(num_starts, thread_limit() * FUNCS_PER_THREAD);
+	jobs = calloc(num_jobs, sizeof(struct func_job));
+	if (!jobs)
+		return FALSE;
+	for (k = 0; k < num_jobs; k++) {
+		jobs[k].text = text;
+		jobs[k].text_size = text_size;
+		jobs[k].abi_is_64 = abi_is_64;
+		jobs[k].starts = starts;
+		jobs[k].num_starts = num_starts;
+		jobs[k].ranges = ranges;
+		jobs[k].first = (uint64_t) num_starts * k / num_jobs;
+		jobs[k].last = (uint64_t) num_starts * (k + 1) / num_jobs;
+		jobs[k].analyze = (analysis != NULL);
+		jobs[k].map = map;
+	}
+
+	parallel_for(num_jobs, scan_function_group, jobs);
+
+	for (k = 0; k < num_jobs; k++)
+		if (jobs[k].sites.failed || jobs[k].analysis.failed)
+			ok = FALSE;
+	for (k = 0; ok && (k < num_jobs); k++) {
+		num_bad += jobs[k].num_bad;
+		/* the jobs cover consecutive functions, so the analysis stays in section order */
+		for (i = 0; analysis && (i < jobs[k].analysis.num); i++)
+			scan_events_add(analysis, jobs[k].analysis.events[i].off,
+					jobs[k].analysis.events[i].status);
+		for (i = 0; i < jobs[k].sites.num; i++)
+			if (patch_site(text + jobs[k].sites.events[i].off,
+						journal_off + jobs[k].sites.events[i].off, FALSE,
+						abi_is_64, journal))
+				num_patches++;
+	}
+
+	for (k = 0; k < num_jobs; k++) {
+		free(jobs[k].sites.events);
+		free(jobs[k].analysis.events);
+	}
+	free(jobs);
+
+	*num_patches_out = num_patches;
+	*num_bad_out = num_bad;
+	return ok;
+}
+
+/* streamed sweep: with --stream a code section is never in memory as a whole.  it is swept
+ * through a window of STREAM_WINDOW bytes, which is moved to the next step whenever that
+ * falls outside of it; before that, the patches found in the window are applied and the
+ * extents of the window journal are written back.  the window also holds the STREAM_KEEP
+ * bytes in front of it (patch_insn looks behind a sysenter) and the STREAM_LOOKAHEAD bytes
+ * behind it (an instruction may start in the window and end outside of it; decoding it reads
+ * at most INSN_MAX_LEN bytes).  a run of
+ * padding that reaches the end of the window is continued in the next one, so the sweep
+ * takes the same steps as the sweeps over a mapped section. */
+
+#define STREAM_WINDOW		(4 * 1024 * 1024)
+#define STREAM_KEEP		8
+#define STREAM_LOOKAHEAD	16
+
+struct stream_window {
+	struct macho_image *img;
+	uint64_t text_offset; // of the section in the image
+	uint64_t text_size; // scanned part of the section
+	boolean_t abi_is_64;
+	uint8_t *buf;
+	uint64_t begin, end; // section offsets held from buf + STREAM_KEEP on
+	struct scan_events sites;
+	struct patch_journal journal; // of the window
+	struct patch_journal *section_journal; // if not NULL, receives the window journals
+	uint32_t num_patches;
+	boolean_t failed;
+};
+
+/* stream_flush: applies the patches found in the window and writes back what they changed */
+
+static void stream_flush(struct stream_window *w)
+{
+	struct journal_extent *e;
+	uint64_t off;
+	uint32_t i;
+
+	for (i = 0; i < w->sites.num; i++) {
+		off = w->sites.events[i].off;
+		if (patch_site(w->buf + STREAM_KEEP + (off - w->begin), w->text_offset + off, FALSE,
+					w->abi_is_64, &w->journal))
+			w->num_patches++;
+	}
+	w->sites.num = 0;
+
+	if (w->journal.failed)
+		w->failed = TRUE;
+	for (i = 0; (i < w->journal.num) && !w->failed; i++) {
+		e = &w->journal.extents[i];
+		if (!macho_store(w->img, e->off, e->len, w->journal.bytes + e->data + e->len))
+			w->failed = TRUE;
+	}
+	if (w->section_journal)
+		journal_append(w->section_journal, &w->journal, 0);
+	w->journal.num = 0;
+	w->journal.num_bytes = 0;
+}
+
+/* stream_fill: moves the window to the section offset off */
+
+static void stream_fill(struct stream_window *w, uint64_t off)
+{
+	stream_flush(w);
+	w->begin = off;
+	w->end = min(off + STREAM_WINDOW, w->text_size);
+	if (!macho_read(w->img, w->text_offset + off - STREAM_KEEP,
+				STREAM_KEEP + (w->end - off) + STREAM_LOOKAHEAD, w->buf))
+		w->failed = TRUE;
+}
+
+/* stream_sweep: sweeps [off, end) of the section with the state st, like the loops of
+ * scan_text_section and scan_function_group */
+
+static void stream_sweep(struct stream_window *w, struct scan_state *st, uint64_t off,
+		uint64_t end)
+{
+	struct data_cursor dc;
+	boolean_t padding = FALSE;
+	uint64_t limit;
+	uint32_t len;
+	uint8_t *p, pad = 0, status;
+
+	data_seek(&dc, st->ranges, off);
+	for (off = data_skip(&dc, off); (off < end) && !w->failed; off = data_skip(&dc, off + len)) {
+		if ((off < w->begin) || (off >= w->end)) {
+			stream_fill(w, off);
+			if (w->failed)
+				break;
+		}
+		p = w->buf + STREAM_KEEP + (off - w->begin);
+		limit = min(end, w->end);
+
+		if (padding) {
+			/* the run of padding the last window ended in goes on */
+			padding = FALSE;
+			for (len = 0; (off + len < limit) && (p[len] == pad); len++)
+				;
+			if (len) {
+				padding = (off + len == w->end) && (w->end < end);
+				continue;
+			}
+		}
+
+		/* the lookahead holds the bytes of a rule that crosses the window end */
+		len = scan_step_to(p, p + (limit - off), p + (end - off), st->abi_is_64, &status);
+		scan_apply(st, off, status);
+		if ((status & STATUS_PADDING) && (off + len == w->end) && (w->end < end) &&
+				!is_long_nop(p)) { // a NOP is a step of its own
+			padding = TRUE;
+			pad = *p;
+		}
+	}
+}
+
+/* stream_code_section: patches [0, text_size) of the code section at text_offset, one
+ * function at a time if starts is not NULL.  returns FALSE if reading or writing the image
+ * failed. */
+
+static boolean_t stream_code_section(struct macho_image *img, uint64_t text_offset,
+		uint64_t text_size, boolean_t abi_is_64, uint64_t *starts, uint32_t num_starts,
+		const struct data_ranges *ranges, struct patch_journal *journal,
+		uint32_t *num_patches_out, uint32_t *num_bad_out)
+{
+	struct stream_window w;
+	struct scan_state st;
+	uint32_t f, num_bad = 0;
+
+	if (text_offset < STREAM_KEEP)
+		return FALSE;
+	memset(&w, 0, sizeof(w));
+	w.img = img;
+	w.text_offset = text_offset;
+	w.text_size = text_size;
+	w.abi_is_64 = abi_is_64;
+	w.section_journal = journal;
+	w.buf = malloc(STREAM_KEEP + STREAM_WINDOW + STREAM_LOOKAHEAD);
+	if (!w.buf)
+		return FALSE;
+
+	for (f = 0; (f < (starts ? num_starts : 1)) && !w.failed; f++) {
+		memset(&st, 0, sizeof(st));
+		st.should_patch = TRUE;
+		st.abi_is_64 = abi_is_64;
+		st.defer = &w.sites;
+		st.ranges = ranges;
+		if (starts)
+			stream_sweep(&w, &st, starts[f],
+					(f + 1 < num_starts) ? starts[f + 1] : text_size);
+		else
+			stream_sweep(&w, &st, 0, text_size);
+		num_bad += st.num_bad;
+	}
+	stream_flush(&w);
+	if (w.sites.failed)
+		w.failed = TRUE;
+
+	free(w.buf);
+	free(w.sites.events);
+	journal_free(&w.journal);
+	*num_patches_out = w.num_patches;
+	*num_bad_out = num_bad;
+	return !w.failed;
+}
+
+/* patch_code_section: prescans and patches one code section; runs as a job of
+ * patch_image. */
+
+struct section_job {
+	struct macho_image *img;
+	const struct macho_section *sect;
+	boolean_t abi_is_64;
+	boolean_t verbose;
+	boolean_t bypass;
+	boolean_t failed;
+	boolean_t io_error;
+	uint32_t num_patches;
+	uint32_t num_bad;
+	struct patch_journal journal; // of the section, if the image has one
+	struct scan_events *analysis; // of the section, if the image has one
+	struct insn_map *map; // of the section, if the image has an analysis
+};
+
+static void patch_code_section(void *ctx, uint32_t index)
+{
+	struct section_job *job = (struct section_job *) ctx + index;
+	struct macho_image *img = job->img;
+	const struct macho_section *sect = job->sect;
+	uint8_t *addr = img->base;
+	mach_vm_size_t map_size = img->size;
+	boolean_t abi_is_64 = job->abi_is_64;
+	boolean_t verbose = job->verbose;
+	uint64_t text_addr, text_size;
+	uint32_t text_offset;
+	uint8_t *text_data;
+	uint64_t tmp_size;
+	uint32_t num_patches, num_bad;
+	uint64_t *starts;
+	uint32_t num_starts;
+	struct data_ranges data;
+	uint8_t prescan_data[PRESCAN_SIZE + STREAM_LOOKAHEAD];
+	struct patch_journal *journal = img->journal ? &job->journal : NULL;
+
+	text_addr = sect->addr;
+	text_size = sect->size;
+	text_offset = sect->offset;
+
+	if (verbose)
+		printf("scanning section %.16s,%.16s\n", sect->segname, sect->sectname);
+
+	tmp_size = (uint64_t) text_offset + text_size;
+#ifdef FIXME
+	/* xxx: this check only makes sense if map_addr is guaranteed to be vmaddr */
+	if ((text_addr - map_addr) > map_size) {
+		printf("text section address not within mapped range\n");
+		job->failed = TRUE;
+		return;
+	} else
+#endif
+	if (tmp_size > map_size) {
+		msg("%.16s,%.16s section offset and size greater than mapping size\n",
+				sect->segname, sect->sectname);
+		job->failed = TRUE;
+		return;
+	} else if ((tmp_size + 16) > map_size) {
+		/* take care not to access anything beyond the mapped range if the text
+		 * section ends within 16 bytes (maximum instruction length is 15 bytes)
+		 * of the end */
+		if (text_size <= 16 - (map_size - tmp_size))
+			return;
+		text_size -= 16 - (map_size - tmp_size);
+	}
+
+	if (img->fd >= 0) {
+		/* streaming: only what the prescan looks at is read here */
+		if (!macho_read(img, text_offset, min(text_size, PRESCAN_SIZE) + STREAM_LOOKAHEAD,
+					prescan_data)) {
+			printf("reading %.16s,%.16s failed\n", sect->segname, sect->sectname);
+			job->failed = job->io_error = TRUE;
+			return;
+		}
+		text_data = prescan_data;
+	} else
+		text_data = (uint8_t *) addr + text_offset;
+
+	if (verbose) {
+		uint32_t n;
+		for (n = 0; n < min(text_size, 16); n++)
+			printf("%02x ", text_data[n]);
+		printf("\n");
+	}
+
+	collect_data_in_code(img, sect, text_size, &data);
+	if (verbose && data.num)
+		printf("skipping %d data ranges\n", data.num);
+
+	/* before attempting to patch anything, scan through some of the section and verify
+	 * that what we are attempting to patch is not total garbage. */
+	num_bad = scan_text_section(text_data, min(text_size, PRESCAN_SIZE), text_addr, &data,
+			FALSE, abi_is_64, verbose, &num_patches);
+	if (verbose)
+		printf("prescan found %d bad instructions\n", num_bad);
+	if (num_bad >= PRESCAN_MAX_BAD) {
+		if (verbose)
+			printf("section appears to contain garbage, bypassing patcher\n");
+		free(data.ranges);
+		job->bypass = TRUE;
+		return;
+	}
+	if (job->map && !alloc_insn_map(job->map, text_size)) {
+		printf("out of memory while scanning %.16s,%.16s\n", sect->segname, sect->sectname);
+		free(data.ranges);
+		job->failed = TRUE;
+		return;
+	}
+
+	/* now that we have decided the section contains valid code, scan through the whole
+	 * section and perform the actual patching. */
+	if (img->fd >= 0) {
+		uint32_t prescan_bad = num_bad;
+		boolean_t ok;
+
+		num_starts = linear_scan ? 0 : collect_function_starts(img, sect, &starts);
+		ok = stream_code_section(img, text_offset, text_size, abi_is_64,
+				num_starts ? starts : NULL, num_starts, &data, journal, &num_patches,
+				&num_bad);
+		if (num_starts)
+			free(starts);
+		if (!ok) {
+			printf("streaming %.16s,%.16s failed\n", sect->segname, sect->sectname);
+			free(data.ranges);
+			job->failed = job->io_error = TRUE;
+			return;
+		}
+		if (sparse_scan)
+			num_bad = prescan_bad;
+	} else if (!verbose && !linear_scan &&
+			(num_starts = collect_function_starts(img, sect, &starts))) {
+		uint32_t prescan_bad = num_bad;
+		boolean_t ok = scan_functions(text_data, text_size, abi_is_64, starts, num_starts,
+				&data, journal, text_offset, job->analysis, job->map, &num_patches,
+				&num_bad);
+		free(starts);
+		if (!ok) {
+			printf("out of memory while scanning %.16s,%.16s\n", sect->segname,
+					sect->sectname);
+			free(data.ranges);
+			job->failed = TRUE;
+			return;
+		}
+		if (sparse_scan)
+			num_bad = prescan_bad;
+	} else if (sparse_scan && !verbose && !job->analysis) {
+		/* the sparse sweep doesn't decode everything, so keep the prescan count */
+		scan_section(text_data, text_size, text_addr, &data, TRUE, abi_is_64, verbose,
+				journal, text_offset, NULL, NULL, &num_patches);
+	} else
+		num_bad = scan_section(text_data, text_size, text_addr, &data, TRUE, abi_is_64,
+				verbose, journal, text_offset, job->analysis, job->map, &num_patches);
+	free(data.ranges);
+	if (verbose)
+		printf("complete scan found %d bad instructions\n", num_bad);
+
+	job->num_patches = num_patches;
+	job->num_bad = num_bad;
+}
+
+/* patch_image: patches all code sections of the image, each as a separate job.  a section
+ * that looks like garbage is bypassed on its own; *bypass reports whether any was.  if
+ * report is not NULL, it receives the results of every section. */
+
+static kern_return_t patch_image(struct macho_image *img, boolean_t abi_is_64,
+		boolean_t verbose, boolean_t *bypass, uint32_t *num_patches_out,
+		uint32_t *num_bad_out, struct patch_report *report)
+{
+	struct section_job *jobs;
+	uint32_t num_jobs, n;
+	kern_return_t ret = KERN_SUCCESS;
+
+	*bypass = FALSE;
+	*num_patches_out = 0;
+	*num_bad_out = 0;
+	if (report) {
+		report->sections = NULL;
+		report->num_sections = 0;
+	}
+
+	jobs = calloc(img->num_sections ? img->num_sections : 1, sizeof(struct section_job));
+	if (!jobs)
+		return KERN_FAILURE;
+	for (n = 0, num_jobs = 0; n < img->num_sections; n++) {
+		if (!is_code_section(&img->sections[n]))
+			continue;
+		jobs[num_jobs].img = img;
+		jobs[num_jobs].sect = &img->sections[n];
+		jobs[num_jobs].abi_is_64 = abi_is_64;
+		jobs[num_jobs].verbose = verbose;
+		num_jobs++;
+	}
+	if (!num_jobs) {
+		if (verbose)
+			printf("no code sections found (text segment appears to contain garbage, "
+					"bypassing patcher)\n");
+		free(jobs);
+		*bypass = TRUE;
+		return KERN_FAILURE;
+	}
+	if (img->analysis) {
+		img->analysis->sections = calloc(num_jobs, sizeof(struct section_analysis));
+		if (!img->analysis->sections) {
+			free(jobs);
+			return KERN_FAILURE;
+		}
+		img->analysis->num_sections = num_jobs;
+		for (n = 0; n < num_jobs; n++) {
+			img->analysis->sections[n].sect = jobs[n].sect;
+			jobs[n].analysis = &img->analysis->sections[n].events;
+			jobs[n].map = &img->analysis->sections[n].map;
+		}
+	}
+
+	if (verbose) {
+		for (n = 0; n < num_jobs; n++)
+			patch_code_section(jobs, n);
+	} else
+		parallel_for(num_jobs, patch_code_section, jobs);
+
+	if (report)
+		report->sections = calloc(num_jobs, sizeof(struct section_report));
+	for (n = 0; n < num_jobs; n++) {
+		*num_patches_out += jobs[n].num_patches;
+		*num_bad_out += jobs[n].num_bad;
+		if (jobs[n].bypass)
+			*bypass = TRUE;
+		if (jobs[n].failed || (jobs[n].analysis && jobs[n].analysis->failed))
+			ret = KERN_FAILURE;
+		if (jobs[n].io_error)
+			img->io_error = TRUE;
+		if (img->journal)
+			journal_append(img->journal, &jobs[n].journal, 0);
+		journal_free(&jobs[n].journal);
+		if (report && report->sections) {
+			struct section_report *r = &report->sections[report->num_sections++];
+			memcpy(r->segname, jobs[n].sect->segname, sizeof(r->segname));
+			memcpy(r->sectname, jobs[n].sect->sectname, sizeof(r->sectname));
+			r->bypass = jobs[n].bypass;
+			r->num_patches = jobs[n].num_patches;
+			r->num_bad = jobs[n].num_bad;
+		}
+	}
+	free(jobs);
+
+	return ret;
+}
+
+/* patch_text_segment: indexes the image and patches it, see patch_image. */
+/* note: the map_addr and map_size arguments are used only for error checking. */
+
+kern_return_t patch_text_segment(uint8_t *addr, __unused mach_vm_offset_t map_addr,
+		mach_vm_size_t map_size, boolean_t abi_is_64, boolean_t seg_is_64,
+		boolean_t verbose, boolean_t *bypass, uint32_t *num_patches_out,
+		uint32_t *num_bad_out, struct patch_report *report)
+{
+	struct macho_image img;
+	kern_return_t ret;
+
+	if (!macho_image_init(&img, addr, map_size, seg_is_64)) {
+		macho_image_free(&img);
+		*bypass = TRUE;
+		*num_patches_out = 0;
+		*num_bad_out = 0;
+		return KERN_FAILURE;
+	}
+	ret = patch_image(&img, abi_is_64, verbose, bypass, num_patches_out, num_bad_out,
+			report);
+	macho_image_free(&img);
+	return ret;
+}
+
+/* remove_linkedit_blob: zeroes the data of lc and removes lc from the load commands (the
+ * command itself is zeroed in place, the header counts are reduced).  the fields touched
+ * are the same in mach_header and mach_header_64. */
+
+static void remove_linkedit_blob(struct macho_image *img, struct linkedit_data_command *lc)
+{
+	struct mach_header mh;
+
+	/* Zero code signature... */
+	macho_write(img, lc->dataoff, lc->datasize, NULL);
+
+	/* Reduce the number of load commands + load command size */
+	memcpy(&mh, img->base, sizeof(mh));
+	mh.ncmds -= 1;
+	mh.sizeofcmds -= lc->cmdsize;
+	macho_write(img, 0, sizeof(mh), &mh);
+
+	/* Zero out load command */
+	macho_write(img, (uint8_t *) lc - img->base, sizeof(struct linkedit_data_command), NULL);
+}
+
+/* compaction: the code signature is normally the last blob of __LINKEDIT (with the DRS right
+ * in front of it), and __LINKEDIT the last segment.  such trailing blobs are cut off: their
+ * load commands are removed from the list, __LINKEDIT and the image shrink, and img->size is
+ * set to the new end of the image.  blobs that are followed by other data are left to
+ * remove_linkedit_blob. */
+
+static struct macho_segment *macho_find_segment(struct macho_image *img, const char *segname)
+{
+	uint32_t n;
+
+	for (n = 0; n < img->num_segments; n++)
+		if (!strncmp(img->segments[n].segname, segname, sizeof(img->segments[n].segname)))
+			return &img->segments[n];
+	return NULL;
+}
+
+/* macho_remove_command: takes lc out of the load command list, moving the following
+ * commands down and clearing the freed space at the end.  the moved commands are copied
+ * first: macho_write must not be handed bytes of the image it changes. */
+
+static void macho_remove_command(struct macho_image *img, struct load_command *lc)
+{
+	struct mach_header mh;
+	uint64_t off = (uint8_t *) lc - img->base, cmds_end, len;
+	uint32_t size = lc->cmdsize;
+	uint8_t *moved;
+
+	memcpy(&mh, img->base, sizeof(mh));
+	cmds_end = mh.sizeofcmds +
+		(img->is_64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header));
+	len = cmds_end - (off + size);
+	moved = malloc(len ? len : 1);
+	if (!moved || !macho_read(img, off + size, len, moved)) {
+		free(moved);
+		img->io_error = TRUE;
+		return;
+	}
+	macho_write(img, off, len, moved);
+	free(moved);
+	macho_write(img, cmds_end - size, size, NULL);
+	mh.ncmds -= 1;
+	mh.sizeofcmds -= size;
+	macho_write(img, 0, sizeof(mh), &mh);
+}
+
+/* linkedit_can_cut: whether [cut, end) of __LINKEDIT holds nothing but the blob ending at
+ * blob_end and padding */
+
+static boolean_t linkedit_can_cut(struct macho_image *img, uint64_t cut, uint64_t blob_end,
+		uint64_t end)
+{
+	struct linkedit_data_command *blobs[] = { img->function_starts, img->data_in_code };
+	struct symtab_command *symtab = img->symtab;
+	uint64_t nlist_size = img->is_64 ? sizeof(struct nlist_64) : sizeof(struct nlist);
+	uint32_t n;
+
+	if ((cut > blob_end) || (blob_end > end))
+		return FALSE;
+	for (n = 0; n < sizeof(blobs) / sizeof(blobs[0]); n++)
+		if (blobs[n] && blobs[n]->datasize &&
+				((uint64_t) blobs[n]->dataoff + blobs[n]->datasize > cut))
+			return FALSE;
+	if (symtab && (((uint64_t) symtab->stroff + symtab->strsize > cut) ||
+				((uint64_t) symtab->symoff + symtab->nsyms * nlist_size > cut)))
+		return FALSE;
+	for (; blob_end < end; blob_end++)
+		if (img->base[blob_end])
+			return FALSE;
+	return TRUE;
+}
+
+static boolean_t compact_linkedit(struct macho_image *img)
+{
+	struct linkedit_data_command *blobs[2], *tmp;
+	struct macho_segment *linkedit;
+	struct patch_journal *journal;
+	uint64_t end, image_end, lc_off;
+	uint32_t n, num_blobs = 0, num_cut = 0;
+
+	linkedit = macho_find_segment(img, "__LINKEDIT");
+	if (!linkedit || (linkedit->fileoff + linkedit->filesize > img->size))
+		return FALSE;
+	if (img->code_signature)
+		blobs[num_blobs++] = img->code_signature;
+	if (img->drs)
+		blobs[num_blobs++] = img->drs;
+	if ((num_blobs == 2) && (blobs[0]->dataoff < blobs[1]->dataoff)) {
+		tmp = blobs[0];
+		blobs[0] = blobs[1];
+		blobs[1] = tmp;
+	}
+
+	/* cut from the end of __LINKEDIT while the last blob is trailing */
+	end = linkedit->fileoff + linkedit->filesize;
+	for (n = 0; n < num_blobs; n++) {
+		if ((blobs[n]->dataoff < linkedit->fileoff) || !linkedit_can_cut(img,
+					blobs[n]->dataoff, (uint64_t) blobs[n]->dataoff +
+					blobs[n]->datasize, end))
+			break;
+		end = blobs[n]->dataoff;
+		num_cut++;
+	}
+	if (!num_cut)
+		return FALSE;
+
+	/* nothing but __LINKEDIT may end behind the new end */
+	image_end = end;
+	for (n = 0; n < img->num_segments; n++)
+		if ((&img->segments[n] != linkedit) && img->segments[n].filesize &&
+				(img->segments[n].fileoff + img->segments[n].filesize > image_end))
+			return FALSE;
+
+	lc_off = (uint8_t *) linkedit->lc - img->base;
+	if (img->is_64) {
+		uint64_t filesize = end - linkedit->fileoff;
+		macho_write(img, lc_off + offsetof(struct segment_command_64, filesize),
+				sizeof(filesize), &filesize);
+	} else {
+		uint32_t filesize = (uint32_t) (end - linkedit->fileoff);
+		macho_write(img, lc_off + offsetof(struct segment_command, filesize),
+				sizeof(filesize), &filesize);
+	}
+
+	/* blobs that aren't trailing are zeroed as before */
+	for (n = num_cut; n < num_blobs; n++)
+		macho_write(img, blobs[n]->dataoff, blobs[n]->datasize, NULL);
+
+	/* remove the later command first, the earlier one doesn't move then */
+	if ((num_blobs == 2) && ((uint8_t *) blobs[0] < (uint8_t *) blobs[1])) {
+		tmp = blobs[0];
+		blobs[0] = blobs[1];
+		blobs[1] = tmp;
+	}
+	for (n = 0; n < num_blobs; n++)
+		macho_remove_command(img, (struct load_command *) blobs[n]);
+
+	/* the load commands moved, so index the image again */
+	journal = img->journal;
+	macho_image_free(img);
+	macho_image_init(img, img->base, image_end, img->is_64);
+	img->journal = journal;
+	return TRUE;
+}
+
+kern_return_t remove_code_signature(struct macho_image *img)
+{
+	const char *width = img->is_64 ? "64bit" : "32bit";
+	mach_vm_size_t size = img->size;
+
+	/* Safety check */
+	if (!img->code_signature && !img->drs)
+	{
+		msg("No code signature found, skipping patch\n");
+		return KERN_FAILURE;
+	}
+
+	if (compact_output && (img->fd < 0) && compact_linkedit(img))
+	{
+		msg("Code signature removed and image compacted by %llu bytes (%s)\n",
+				(unsigned long long) (size - img->size), width);
+		return KERN_SUCCESS;
+	}
+
+	if (img->code_signature)
+	{
+		remove_linkedit_blob(img, img->code_signature);
+		img->code_signature = NULL;
+		msg("Code signature (SIG) removed succesfully (%s)\n", width);
+	}
+
+	if (img->drs)
+	{
+		remove_linkedit_blob(img, img->drs);
+		img->drs = NULL;
+		msg("Code signature (DRS) removed succesfully (%s)\n", width);
+	}
+
+	return KERN_SUCCESS;
+}
+
+#ifndef INSN_PATCHER_NO_MAIN
+
+/* result cache (--cache <dir>): most slices are byte-identical from one run to the next, so
+ * what patch_image did to a slice -- its journal and its report -- is saved under a hash of
+ * the slice and replayed when the same slice comes along again, without scanning it.  the
+ * name of an entry also holds the patcher variant and the scan options, which change the
+ * results.  entries are written to a temporary file and renamed, so parallel writers of the
+ * same entry don't clash. */
+
+static const char *cache_dir = NULL;
+
+#ifndef CODESIGSTRIP
+
+/* the patcher variant names the selected rule set in cache entries and patch markers: "std"
+ * and "ext" for the standard and the extended set, "r" and the rule bits in hex for others
+ * and "usr" with user rules (cache entries then also hold a hash of them).
+ * init_patcher_variant sets it (and the marker owner) once the rules are selected. */
+
+static char patcher_variant[4];
+static char marker_owner[sizeof(MARKER_OWNER) + 3];
+
+static void init_patcher_variant(void)
+{
+	uint32_t rules = selected_patch_rules();
+
+	if (num_user_rules)
+		strcpy(patcher_variant, "usr");
+	else if (rules == RULES_STANDARD)
+		strcpy(patcher_variant, "std");
+	else if (rules == RULES_EXTENDED)
+		strcpy(patcher_variant, "ext");
+	else
+		snprintf(patcher_variant, sizeof(patcher_variant), "r%02x", rules);
+	snprintf(marker_owner, sizeof(marker_owner), "%s%s", MARKER_OWNER, patcher_variant);
+}
+
+#define CACHE_MAGIC		"INSNPC01"
+#define HASH_CHUNK		(1 << 20)	// whole stripes
+
+struct cache_header {
+	char magic[8];
+	uint64_t hash;
+	uint64_t size;
+	int32_t ret;
+	uint32_t bypass;
+	uint32_t num_patches;
+	uint32_t num_bad;
+	uint32_t num_sections;
+	uint32_t num_extents;
+	uint64_t num_bytes;
+};
+
+/* the slices are hashed with xxHash64 (seed 0), in parts for streamed images: hash_stripes
+ * takes the whole 32-byte stripes of a part, hash_finish the rest after the last one. */
+
+#define PRIME64_1		0x9E3779B185EBCA87ULL
+#define PRIME64_2		0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3		0x165667B19E3779F9ULL
+#define PRIME64_4		0x85EBCA77C2B2AE63ULL
+#define PRIME64_5		0x27D4EB2F165667C5ULL
+
+struct hash_state {
+	uint64_t v[4];
+	uint64_t total;
+};
+
+static inline uint64_t hash_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_read64(const uint8_t *p)
+{
+	uint64_t x;
+
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	return hash_rotl(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= hash_round(0, v);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void hash_init(struct hash_state *h)
+{
+	h->v[0] = PRIME64_1 + PRIME64_2;
+	h->v[1] = PRIME64_2;
+	h->v[2] = 0;
+	h->v[3] = -PRIME64_1;
+	h->total = 0;
+}
+
+static uint64_t hash_stripes(struct hash_state *h, const uint8_t *p, uint64_t len)
+{
+	uint64_t n;
+
+	for (n = 0; n + 32 <= len; n += 32) {
+		h->v[0] = hash_round(h->v[0], hash_read64(p + n));
+		h->v[1] = hash_round(h->v[1], hash_read64(p + n + 8));
+		h->v[2] = hash_round(h->v[2], hash_read64(p + n + 16));
+		h->v[3] = hash_round(h->v[3], hash_read64(p + n + 24));
+	}
+	h->total += n;
+	return n;
+}
+
+static uint64_t hash_finish(struct hash_state *h, const uint8_t *p, uint64_t len)
+{
+	uint64_t acc;
+	uint32_t x;
+	uint64_t n;
+
+	if (h->total) {
+		acc = hash_rotl(h->v[0], 1) + hash_rotl(h->v[1], 7) + hash_rotl(h->v[2], 12) +
+			hash_rotl(h->v[3], 18);
+		for (n = 0; n < 4; n++)
+			acc = hash_merge(acc, h->v[n]);
+	} else
+		acc = PRIME64_5;
+	acc += h->total + len;
+
+	for (n = 0; n + 8 <= len; n += 8) {
+		acc ^= hash_round(0, hash_read64(p + n));
+		acc = hash_rotl(acc, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (n + 4 <= len) {
+		memcpy(&x, p + n, sizeof(x));
+		acc ^= x * PRIME64_1;
+		acc = hash_rotl(acc, 23) * PRIME64_2 + PRIME64_3;
+		n += 4;
+	}
+	for (; n < len; n++) {
+		acc ^= p[n] * PRIME64_5;
+		acc = hash_rotl(acc, 11) * PRIME64_1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= PRIME64_2;
+	acc ^= acc >> 29;
+	acc *= PRIME64_3;
+	acc ^= acc >> 32;
+	return acc;
+}
+
+static boolean_t hash_image(struct macho_image *img, uint64_t *hash)
+{
+	struct hash_state h;
+	uint64_t off, len, n;
+	uint8_t *buf;
+
+	hash_init(&h);
+	if (img->fd < 0) {
+		n = hash_stripes(&h, img->base, img->size);
+		*hash = hash_finish(&h, img->base + n, img->size - n);
+		return TRUE;
+	}
+
+	buf = malloc(HASH_CHUNK);
+	if (!buf)
+		return FALSE;
+	for (off = 0; ; off += n) {
+		len = min(img->size - off, HASH_CHUNK);
+		if (!macho_read(img, off, len, buf)) {
+			free(buf);
+			return FALSE;
+		}
+		n = hash_stripes(&h, buf, len);
+		if ((n < len) || (off + n == img->size)) {
+			*hash = hash_finish(&h, buf + n, len - n);
+			break;
+		}
+	}
+	free(buf);
+	return TRUE;
+}
+
+/* cache_path: returns the (allocated) name of the cache entry of an image */
+
+static char *cache_path(uint64_t hash, uint64_t size)
+{
+	char *path = malloc(strlen(cache_dir) + 96);
+	char rules[32] = "";
+	struct hash_state h;
+
+	if (num_user_rules) {
+		hash_init(&h);
+		snprintf(rules, sizeof(rules), "-%02x%016llx", selected_patch_rules(),
+				(unsigned long long) hash_finish(&h, (const uint8_t *) user_rules,
+					num_user_rules * sizeof(struct user_rule)));
+	}
+	if (path)
+		sprintf(path, "%s/%016llx-%llx-%s%s%s%s", cache_dir, (unsigned long long) hash,
+				(unsigned long long) size, patcher_variant, rules,
+				sparse_scan ? "-sparse" : "", linear_scan ? "-linear" : "");
+	return path;
+}
+
+/* cache_load: reads the cache entry at path into hdr, report and journal.  returns FALSE if
+ * there is none or it doesn't belong to the image. */
+
+static boolean_t cache_load(const char *path, uint64_t hash, struct macho_image *img,
+		struct cache_header *hdr, struct patch_report *report,
+		struct patch_journal *journal)
+{
+	struct journal_extent *e;
+	boolean_t ok;
+	uint32_t i;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return FALSE;
+	ok = (fread(hdr, sizeof(*hdr), 1, f) == 1) &&
+		!memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) &&
+		(hdr->hash == hash) && (hdr->size == img->size) &&
+		(hdr->num_sections <= img->num_sections) && (hdr->num_bytes <= 2 * img->size);
+	if (ok) {
+		report->sections = calloc(hdr->num_sections ? hdr->num_sections : 1,
+				sizeof(struct section_report));
+		journal->extents = malloc((hdr->num_extents ? hdr->num_extents : 1) *
+				sizeof(struct journal_extent));
+		journal->bytes = malloc(hdr->num_bytes ? hdr->num_bytes : 1);
+		ok = report->sections && journal->extents && journal->bytes &&
+			(fread(report->sections, sizeof(struct section_report),
+			       hdr->num_sections, f) == hdr->num_sections) &&
+			(fread(journal->extents, sizeof(struct journal_extent),
+			       hdr->num_extents, f) == hdr->num_extents) &&
+			(fread(journal->bytes, 1, hdr->num_bytes, f) == hdr->num_bytes);
+		report->num_sections = hdr->num_sections;
+		journal->num = journal->max = hdr->num_extents;
+		journal->num_bytes = journal->max_bytes = hdr->num_bytes;
+	}
+	fclose(f);
+
+	for (i = 0; ok && (i < journal->num); i++) {
+		e = &journal->extents[i];
+		ok = (e->len <= img->size) && (e->off <= img->size - e->len) &&
+			(e->data <= journal->num_bytes) &&
+			(e->len <= (journal->num_bytes - e->data) / 2);
+	}
+	if (!ok) {
+		free(report->sections);
+		report->sections = NULL;
+		report->num_sections = 0;
+		journal_free(journal);
+	}
+	return ok;
+}
+
+/* cache_store: saves an entry at path; failures only cost the entry */
+
+static void cache_store(const char *path, const struct cache_header *hdr,
+		const struct patch_report *report, const struct patch_journal *journal)
+{
+	char *tmp;
+	FILE *f;
+	boolean_t ok;
+	int fd;
+
+	tmp = malloc(strlen(path) + 8);
+	if (!tmp)
+		return;
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return;
+	}
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+	ok = (fwrite(hdr, sizeof(*hdr), 1, f) == 1) &&
+		(fwrite(report->sections, sizeof(struct section_report), hdr->num_sections, f) ==
+		 hdr->num_sections) &&
+		(fwrite(journal->extents, sizeof(struct journal_extent), hdr->num_extents, f) ==
+		 hdr->num_extents) &&
+		(fwrite(journal->bytes, 1, hdr->num_bytes, f) == hdr->num_bytes);
+	if ((fclose(f) != 0) || !ok || (rename(tmp, path) != 0))
+		unlink(tmp);
+	free(tmp);
+}
+
+/* patch_image_cached: patch_image with the result cache.  on a hit the changes are replayed
+ * from the entry (and recorded in the journal of the image like any others); on a miss the
+ * image is patched and the entry saved.  the per-instruction output of verbose runs can't be
+ * replayed, so those don't use the cache. */
+
+static kern_return_t patch_image_cached(struct macho_image *img, boolean_t abi_is_64,
+		boolean_t verbose, boolean_t *bypass, uint32_t *num_patches_out,
+		uint32_t *num_bad_out, struct patch_report *report)
+{
+	struct patch_journal journal, *saved = img->journal;
+	struct cache_header hdr;
+	struct journal_extent *e;
+	kern_return_t ret;
+	uint64_t hash;
+	uint32_t i;
+	char *path;
+
+	if (!cache_dir || verbose || !hash_image(img, &hash))
+		return patch_image(img, abi_is_64, verbose, bypass, num_patches_out, num_bad_out,
+				report);
+	path = cache_path(hash, img->size);
+	if (!path)
+		return patch_image(img, abi_is_64, verbose, bypass, num_patches_out, num_bad_out,
+				report);
+
+	memset(&journal, 0, sizeof(journal));
+	if (cache_load(path, hash, img, &hdr, report, &journal)) {
+		for (i = 0; i < journal.num; i++) {
+			e = &journal.extents[i];
+			macho_write(img, e->off, e->len, journal.bytes + e->data + e->len);
+		}
+		*bypass = hdr.bypass;
+		*num_patches_out = hdr.num_patches;
+		*num_bad_out = hdr.num_bad;
+		journal_free(&journal);
+		free(path);
+		return hdr.ret;
+	}
+
+	img->journal = &journal;
+	ret = patch_image(img, abi_is_64, verbose, bypass, num_patches_out, num_bad_out, report);
+	img->journal = saved;
+	journal_sort(&journal);
+
+	/* a section that failed for lack of memory isn't a result worth keeping */
+	if (((ret == KERN_SUCCESS) || !report->num_sections) && !img->io_error &&
+			!journal.failed) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+		hdr.hash = hash;
+		hdr.size = img->size;
+		hdr.ret = ret;
+		hdr.bypass = *bypass;
+		hdr.num_patches = *num_patches_out;
+		hdr.num_bad = *num_bad_out;
+		hdr.num_sections = report->num_sections;
+		hdr.num_extents = journal.num;
+		hdr.num_bytes = journal.num_bytes;
+		cache_store(path, &hdr, report, &journal);
+	}
+	if (saved)
+		journal_append(saved, &journal, 0);
+	journal_free(&journal);
+	free(path);
+	return ret;
+}
+
+/* patch markers: running the tool on its own output would decode all of __text again only
+ * to find nothing (patched sites decode fine).  so with --mark every image it processed gets
+ * a marker (see struct patch_marker) naming the variant, and images that carry the marker
+ * of this variant are not scanned again -- the check is a field of the load command index.
+ * the marker goes into the slack between the load commands and the first section data; it
+ * adds a load command, so it is opt-in, and images without room are left alone (and scanned
+ * again the next time). */
+
+static boolean_t mark_output = FALSE;
+
+static boolean_t is_marked(struct macho_image *img)
+{
+	/* the marker doesn't tell which user rules were applied */
+	if (num_user_rules)
+		return FALSE;
+	return img->marker && !strncmp(img->marker->data_owner, marker_owner,
+			sizeof(img->marker->data_owner));
+}
+
+static void mark_image(struct macho_image *img)
+{
+	struct patch_marker marker;
+	struct mach_header mh;
+	struct load_command *lc;
+	uint64_t off, cmds_end, data_start = img->size;
+	uint8_t slack[sizeof(struct patch_marker)];
+	uint32_t n;
+
+	if (!mark_output || is_marked(img))
+		return;
+	if (img->marker) {
+		/* left by another variant */
+		macho_write(img, (uint8_t *) img->marker - img->base +
+				offsetof(struct patch_marker, data_owner),
+				sizeof(img->marker->data_owner), marker_owner);
+		return;
+	}
+
+	/* the load commands must end where the header says */
+	memcpy(&mh, img->base, sizeof(mh));
+	off = img->is_64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header);
+	cmds_end = off + mh.sizeofcmds;
+	for (n = 0; (n < mh.ncmds) && (off + sizeof(struct load_command) <= cmds_end); n++) {
+		lc = (struct load_command *) (img->base + off);
+		if (lc->cmdsize < sizeof(struct load_command))
+			return;
+		off += lc->cmdsize;
+	}
+	if ((n < mh.ncmds) || (off != cmds_end))
+		return;
+
+	for (n = 0; n < img->num_sections; n++)
+		if (img->sections[n].size && img->sections[n].offset)
+			data_start = min(data_start, img->sections[n].offset);
+	for (n = 0; n < img->num_segments; n++)
+		if (img->segments[n].filesize && img->segments[n].fileoff)
+			data_start = min(data_start, img->segments[n].fileoff);
+	if ((cmds_end + sizeof(marker) > data_start) ||
+			!macho_read(img, cmds_end, sizeof(slack), slack))
+		return;
+	for (n = 0; n < sizeof(slack); n++)
+		if (slack[n])
+			return;
+
+	memset(&marker, 0, sizeof(marker));
+	marker.cmd = LC_NOTE;
+	marker.cmdsize = sizeof(marker);
+	memcpy(marker.data_owner, marker_owner, sizeof(marker.data_owner));
+	macho_write(img, cmds_end, sizeof(marker), &marker);
+	mh.ncmds += 1;
+	mh.sizeofcmds += sizeof(marker);
+	macho_write(img, 0, sizeof(mh), &mh);
+}
+
+#endif
+
+/* universal binaries: the slices live at disjoint offsets, so their text sections are scanned
+ * in parallel.  the code signatures are removed and the reports printed afterwards, in slice
+ * order, so the output does not depend on thread scheduling. */
+
+struct slice_job {
+	uint8_t *data;
+	uint32_t size;
+	cpu_type_t cputype;
+	kern_return_t result;
+	boolean_t bypass;
+	uint32_t num_patches;
+	uint32_t num_bad;
+	struct patch_report report;
+	struct macho_image img;
+	struct patch_journal journal;
+};
+
+#ifndef CODESIGSTRIP
+static void patch_slice(void *ctx, uint32_t index)
+{
+	struct slice_job *job = (struct slice_job *) ctx + index;
+	boolean_t is_64;
+
+	if (job->cputype == CPU_TYPE_X86_64)
+		is_64 = TRUE;
+	else if (job->cputype == CPU_TYPE_I386)
+		is_64 = FALSE;
+	else
+		return;
+
+	if (is_marked(&job->img))
+		return;
+	job->result = patch_image_cached(&job->img, is_64, VERBOSE, &job->bypass,
+			&job->num_patches, &job->num_bad, &job->report);
+}
+#endif
+
+/* compact_fat: lays out the slices of a universal binary again after compaction shrank some
+ * of them, keeping their order and alignment, and updates the fat_arch entries.  returns the
+ * new size of the file. */
+
+static size_t compact_fat(uint8_t *buffer, size_t filesize, struct slice_job *jobs,
+		uint32_t total_bins)
+{
+	struct fat_arch *archbin = (struct fat_arch *) (buffer + sizeof(struct fat_header));
+	uint32_t *order, n, k, shift;
+	uint64_t end, off, old, size, align;
+
+	for (n = 0; n < total_bins; n++)
+		if ((uint64_t) (jobs[n].data - buffer) + jobs[n].size > filesize)
+			return filesize;
+
+	order = malloc(total_bins * sizeof(uint32_t));
+	if (!order)
+		return filesize;
+	for (n = 0; n < total_bins; n++) {
+		/* insertion sort by file offset */
+		for (k = n; (k > 0) && (jobs[order[k - 1]].data > jobs[n].data); k--)
+			order[k] = order[k - 1];
+		order[k] = n;
+	}
+
+	end = sizeof(struct fat_header) + (uint64_t) total_bins * sizeof(struct fat_arch);
+	for (k = 0; k < total_bins; k++) {
+		n = order[k];
+		size = jobs[n].size;
+		if (jobs[n].img.base && (jobs[n].img.size < size))
+			size = jobs[n].img.size;
+		shift = OSSwapInt32(archbin[n].align);
+		align = (uint64_t) 1 << min(shift, 20);
+		old = jobs[n].data - buffer;
+		off = (end + align - 1) & ~(align - 1);
+		if ((off > old) || (old < end)) {
+			/* overlapping or out of order slices: leave this one where it is */
+			off = old;
+		} else if (off != old) {
+			memmove(buffer + off, buffer + old, size);
+			memset(buffer + end, 0, off - end);
+		}
+		archbin[n].offset = OSSwapInt32((uint32_t) off);
+		archbin[n].size = OSSwapInt32((uint32_t) size);
+		jobs[n].data = buffer + off;
+		jobs[n].size = (uint32_t) size;
+		if (off + size > end)
+			end = off + size;
+	}
+
+	free(order);
+	return end;
+}
+
+/* print_section_reports: one line per code section, if the image has more than one */
+
+static void print_section_reports(struct patch_report *report)
+{
+	struct section_report *r;
+	uint32_t n;
+
+	if (report->num_sections < 2)
+		return;
+	for (n = 0; n < report->num_sections; n++) {
+		r = &report->sections[n];
+		msg("  %.16s,%.16s: %u instructions patched, %u bad instructions, bypassed: %s\n",
+				r->segname, r->sectname, r->num_patches, r->num_bad,
+				r->bypass == TRUE ? "YES" : "NO");
+	}
+}
+
+void Usage(char *name)
+{
+	printf("AnV Mach-O AMD Instruction Patcher V1.03\n");
+	printf("Usage: %s <infile> <outfile>\n", name);
+	printf("       %s --in-place <file>\n", name);
+	printf("       %s --batch <listfile|directory> <outroot>\n", name);
+	printf("       %s --in-place --batch <listfile|directory>\n", name);
+	printf("Options: --sparse  only decode around possible patch sites\n");
+	printf("                   (bad instructions are then only counted by the prescan)\n");
+	printf("         --linear  sweep sections linearly, ignoring function starts\n");
+	printf("         --compact cut the code signature out of the file instead of zeroing it\n");
+	printf("         --stream  read and write the file piecewise instead of mapping it\n");
+	printf("                   (for files larger than memory; no --compact)\n");
+	printf("         --journal <file>\n");
+	printf("                   save the offset, old and new bytes of every change to <file>\n");
+	printf("                   (no --batch or --compact)\n");
+#ifndef CODESIGSTRIP
+	printf("         --rules <list>\n");
+	printf("                   patch what the comma separated rules select: cpuid,\n");
+	printf("                   sysenter_trap, lddqu, fisttp, rest (after absolute jumps),\n");
+	printf("                   standard or extended (default: %s)\n",
+			(selected_patch_rules() == RULES_EXTENDED) ? "extended" : "standard");
+	printf("         --rule-file <file>\n");
+	printf("                   also rewrite the byte patterns of the rules in <file>, one\n");
+	printf("                   per line: <name> <start|whole> <pattern> = <replacement>\n");
+	printf("                   (bytes: hh, hh/mask, ?? any in the pattern, .. kept)\n");
+	printf("         --mark    add a load command (LC_NOTE) marking the images as patched,\n");
+	printf("                   if the header has room for it; marked images are not\n");
+	printf("                   scanned again\n");
+#endif
+	printf("         --cache <dir>\n");
+	printf("                   keep the results of each slice in <dir> and reuse them for\n");
+	printf("                   identical slices instead of scanning them again\n");
+#ifndef CODESIGSTRIP
+	printf("         --analyze <report> <infile>\n");
+	printf("                   change nothing, write the sites that would be patched or\n");
+	printf("                   skipped and the bad instructions to <report> as JSON\n");
+	printf("                   (\"-\" for stdout; only with --linear, --rules and\n");
+	printf("                   --rule-file)\n");
+#endif
+#ifdef EXTENDED_PATCHER
+	printf("Patcher: Extended\n");
+#else
+	printf("Patcher: Standard\n");
+#endif
+	printf("Code signature stripping code also included\n");
+	printf("Copyright (C) 2010 AnV Software\n");
+	printf("Patching routines made by Voodoo team and extended by AnV Software\n");
+}
+
+/* is_macho_file: whether magic (the first 4 bytes of a file) is that of a thin or universal
+ * Mach-O file */
+
+static boolean_t is_macho_file(const uint8_t *magic)
+{
+	return (((magic[0] == 0xCE) || (magic[0] == 0xCF)) && (magic[1] == 0xFA) && (magic[2] == 0xED) && (magic[3] == 0xFE)) ||
+		((magic[0] == 0xCA) && (magic[1] == 0xFE) && (magic[2] == 0xBA) && (magic[3] == 0xBE));
+}
+
+struct file_report {
+	uint32_t num_patches;
+	uint32_t num_bad;
+	uint32_t num_bypassed;
+	boolean_t written;
+};
+
+/* finish_slices: strips the code signatures of the patched slices of a universal binary and
+ * reports them, in slice order.  returns the number of patches. */
+
+static uint32_t finish_slices(struct slice_job *jobs, uint32_t total_bins,
+		struct file_report *rep)
+{
+	uint32_t current_bin;
+	uint32_t total_patches = 0;
+
+	for (current_bin = 0; current_bin < total_bins; current_bin++)
+	{
+		struct slice_job *job = &jobs[current_bin];
+
+		if ((job->cputype == CPU_TYPE_X86_64) || (job->cputype == CPU_TYPE_I386))
+		{
+			msg("Patching %s part (processor %u, architecture %d)\n", job->cputype == CPU_TYPE_X86_64 ? "X86_64" : "I386", job->cputype, current_bin);
+#ifndef CODESIGSTRIP
+			if (is_marked(&job->img))
+				msg("Already patched, skipping scan\n");
+			total_patches += job->num_patches;
+#else
+			total_patches = 1;
+#endif
+			remove_code_signature(&job->img);
+#ifndef CODESIGSTRIP
+			if ((job->result == KERN_SUCCESS) || job->bypass)
+				mark_image(&job->img);
+#endif
+
+			print_section_reports(&job->report);
+			msg("Patch report (%d): %u instructions patched, %u bad instructions, patches bypassed: %s\n", current_bin+1, job->num_patches, job->num_bad, job->bypass == TRUE ? "YES" : "NO");
+		} else {
+			msg("Skipping non-Intel architecture (%d)\n", current_bin);
+			continue;
+		}
+
+		rep->num_patches += job->num_patches;
+		rep->num_bad += job->num_bad;
+		if (job->bypass)
+			rep->num_bypassed++;
+	}
+
+	return total_patches;
+}
+
+/* report_image: reports the results of a thin image */
+
+static void report_image(struct patch_report *report, uint32_t num_patches, uint32_t num_bad,
+		boolean_t bypass, struct file_report *rep)
+{
+	print_section_reports(report);
+	msg("Patch report: %u instructions patched, %u bad instructions, patches bypassed: %s\n", num_patches, num_bad, bypass == TRUE ? "YES" : "NO");
+	rep->num_patches = num_patches;
+	rep->num_bad = num_bad;
+	rep->num_bypassed = bypass ? 1 : 0;
+}
+
+/* --stream: read and write the files piecewise instead of mapping them (see stream_file) */
+static boolean_t stream_mode = FALSE;
+
+/* --journal <file>: save the changes made to the file there */
+static const char *journal_path = NULL;
+
+/* save_journal: writes journal to journal_path, one change per line: the offset in the file,
+ * the length and the bytes before and after the change in hex.  the old and the new bytes
+ * together make it a diff that can be applied in either direction. */
+
+static int save_journal(const char *infile, struct patch_journal *journal)
+{
+	struct journal_extent *e;
+	uint64_t k;
+	uint32_t i;
+	FILE *f;
+
+	journal_sort(journal);
+	if (journal->failed)
+		return -1;
+	f = fopen(journal_path, "w");
+	if (!f)
+		return -1;
+	fprintf(f, "# %s: %u changes\n", infile, journal->num);
+	fprintf(f, "# offset length old new\n");
+	for (i = 0; i < journal->num; i++) {
+		e = &journal->extents[i];
+		fprintf(f, "0x%08llx %llu ", (unsigned long long) e->off, (unsigned long long) e->len);
+		for (k = 0; k < e->len; k++)
+			fprintf(f, "%02x", journal->bytes[e->data + k]);
+		fprintf(f, " ");
+		for (k = 0; k < e->len; k++)
+			fprintf(f, "%02x", journal->bytes[e->data + e->len + k]);
+		fprintf(f, "\n");
+	}
+	return (fclose(f) == 0) ? 0 : -1;
+}
+
+#ifndef CODESIGSTRIP
+/* --analyze <report>: a dry run.  the file is mapped read-only and swept the way patching
+ * would sweep it, but instead of being patched the sections hand back what the sweep found
+ * (see image_analysis), which is written to <report> ("-" for stdout) as compact JSON: for
+ * every x86 slice and code section, each instruction the patcher would rewrite (its file
+ * offset, address and kind), each one it skips because it follows a bad or resting
+ * instruction too closely, and the runs of bad bytes.  the report is fully buffered and
+ * written after each slice, so the sweep runs as fast as when patching. */
+
+#define ANALYSIS_BUFFER		(1024 * 1024)
+
+static const char *analyze_path = NULL;
+
+static const char *patch_kind_name(int kind)
+{
+	if (kind >= PATCH_USER)
+		return user_rules[kind - PATCH_USER].name;
+	switch (kind) {
+	case PATCH_CPUID:
+		return "cpuid";
+	case PATCH_SYSENTER_TRAP:
+		return "sysenter_trap";
+	case PATCH_LDDQU:
+		return "lddqu";
+	case PATCH_FISTTP:
+		return "fisttp";
+	default:
+		return "unrecognized";
+	}
+}
+
+static void json_string(FILE *f, const char *s, size_t max)
+{
+	size_t n;
+
+	fputc('"', f);
+	for (n = 0; (n < max) && s[n]; n++) {
+		if ((s[n] == '"') || (s[n] == '\\'))
+			fprintf(f, "\\%c", s[n]);
+		else if ((unsigned char) s[n] < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char) s[n]);
+		else
+			fputc(s[n], f);
+	}
+	fputc('"', f);
+}
+
+static void analysis_range(FILE *f, uint64_t fileoff, uint64_t addr, uint64_t begin,
+		uint64_t end, uint32_t index)
+{
+	fprintf(f, "%s\n{\"offset\":%llu,\"addr\":%llu,\"length\":%llu}", index ? "," : "",
+			(unsigned long long) (fileoff + begin), (unsigned long long) (addr + begin),
+			(unsigned long long) (end - begin));
+}
+
+/* analyze_section: writes the analysis of one section of the slice at data (file offset
+ * fileoff) and adds what would be patched and skipped to the counters */
+
+static void analyze_section(FILE *f, const uint8_t *data, uint64_t fileoff, boolean_t is_64,
+		struct section_analysis *a, struct section_report *r, uint32_t *num_patches_out,
+		uint32_t *num_skipped_out)
+{
+	const struct macho_section *sect = a->sect;
+	const struct insn_map *m = &a->map;
+	struct scan_event *e;
+	uint32_t i, num_sites = 0, num_patches = 0, num_skipped = 0, num_ranges;
+	uint64_t begin, end;
+	int kind;
+
+	fprintf(f, "{\"segment\":");
+	json_string(f, sect->segname, 16);
+	fprintf(f, ",\"section\":");
+	json_string(f, sect->sectname, 16);
+	fprintf(f, ",\"addr\":%llu,\"offset\":%llu,\"size\":%llu,\"bypass\":%s,\"sites\":[",
+			(unsigned long long) sect->addr, (unsigned long long) (fileoff + sect->offset),
+			(unsigned long long) sect->size, (r && r->bypass) ? "true" : "false");
+	for (i = 0; i < a->events.num; i++) {
+		e = &a->events.events[i];
+		kind = classify_insn((uint8_t *) data + sect->offset + e->off, is_64);
+		fprintf(f, "%s\n{\"offset\":%llu,\"addr\":%llu,\"kind\":\"%s\"%s}",
+				num_sites++ ? "," : "",
+				(unsigned long long) (fileoff + sect->offset + e->off),
+				(unsigned long long) (sect->addr + e->off), patch_kind_name(kind),
+				(e->status & STATUS_SKIPPED) ? ",\"skipped\":\"rest\"" : "");
+		if (e->status & STATUS_SKIPPED)
+			num_skipped++;
+		else if (kind != PATCH_NONE)
+			num_patches++;
+	}
+	fprintf(f, "],\"insns\":%llu,\"bad\":%u,\"bad_ranges\":[",
+			(unsigned long long) (m->starts ? insn_map_count(m->starts, 0, m->size) : 0),
+			r ? r->num_bad : 0);
+	/* every bad byte is a one byte step, so consecutive ones are one range */
+	for (begin = 0, num_ranges = 0; m->bad; begin = end) {
+		begin = insn_map_find(m->bad, begin, m->size, TRUE);
+		if (begin == m->size)
+			break;
+		end = insn_map_find(m->bad, begin, m->size, FALSE);
+		analysis_range(f, fileoff + sect->offset, sect->addr, begin, end, num_ranges++);
+	}
+	fprintf(f, "],\"patches\":%u,\"skipped\":%u}", num_patches, num_skipped);
+
+	*num_patches_out += num_patches;
+	*num_skipped_out += num_skipped;
+}
+
+/* analyze_slice: analyzes the image of size bytes at data (file offset fileoff) and writes
+ * it as one element of the slices of the report */
+
+static void analyze_slice(FILE *f, uint8_t *data, uint64_t size, uint64_t fileoff,
+		cpu_type_t cputype, boolean_t first)
+{
+	boolean_t is_64 = (cputype == CPU_TYPE_X86_64);
+	struct macho_image img;
+	struct image_analysis analysis = { NULL, 0 };
+	struct patch_report report = { NULL, 0 };
+	kern_return_t result = KERN_FAILURE;
+	boolean_t bypass = TRUE;
+	uint32_t n, num_patches = 0, num_skipped = 0, num_bad = 0;
+
+	if (macho_image_init(&img, data, size, is_64)) {
+		img.analysis = &analysis;
+		result = patch_image(&img, is_64, FALSE, &bypass, &num_patches, &num_bad, &report);
+		num_patches = 0;
+	}
+
+	fprintf(f, "%s\n{\"arch\":\"%s\",\"offset\":%llu,\"size\":%llu,\"marked\":%s,"
+			"\"result\":\"%s\",\"bypass\":%s,\"sections\":[", first ? "" : ",",
+			is_64 ? "x86_64" : "i386", (unsigned long long) fileoff,
+			(unsigned long long) size, is_marked(&img) ? "true" : "false",
+			(result == KERN_SUCCESS) ? "success" : "failure", bypass ? "true" : "false");
+	for (n = 0; n < analysis.num_sections; n++) {
+		fprintf(f, "%s\n", n ? "," : "");
+		analyze_section(f, data, fileoff, is_64, &analysis.sections[n],
+				(n < report.num_sections) ? &report.sections[n] : NULL, &num_patches,
+				&num_skipped);
+		free(analysis.sections[n].events.events);
+		free_insn_map(&analysis.sections[n].map);
+	}
+	fprintf(f, "],\"patches\":%u,\"skipped\":%u,\"bad\":%u}", num_patches, num_skipped,
+			num_bad);
+	fflush(f);
+
+	free(analysis.sections);
+	free(report.sections);
+	macho_image_free(&img);
+}
+
+/* analyze_file: writes the analysis of infile to analyze_path.  returns 0 on success, -1 if
+ * the file is not a supported Mach-O file, -2 if it can't be opened and -3 if the report
+ * can't be written (as process_file). */
+
+static int analyze_file(const char *infile)
+{
+	int in, ret = 0;
+	struct stat st;
+	uint8_t magic[4];
+	uint8_t *buffer;
+	size_t filesize;
+	struct fat_arch arch;
+	uint32_t total_bins, n;
+	boolean_t first = TRUE;
+	FILE *f;
+
+	in = open(infile, O_RDONLY);
+	if ((in < 0) || (fstat(in, &st) != 0))
+	{
+		if (in >= 0)
+			close(in);
+		printf("ERROR: Opening input file failed\n");
+
+		return(-2);
+	}
+
+	filesize = (size_t) st.st_size;
+	if ((filesize < sizeof(struct mach_header)) || (pread(in, magic, 4, 0) != 4) ||
+			!is_macho_file(magic))
+	{
+		close(in);
+		printf("ERROR: Unsupported or no Mach-O file\n");
+
+		return(-1);
+	}
+
+	/* read-only: the analysis can't change the file, whatever the scan does */
+	buffer = (uint8_t *) mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, in, 0);
+	close(in);
+	if (buffer == (uint8_t *) MAP_FAILED)
+	{
+		printf("ERROR: Mapping input file failed\n");
+
+		return(-2);
+	}
+
+	f = strcmp(analyze_path, "-") ? fopen(analyze_path, "w") : stdout;
+	if (!f)
+	{
+		munmap(buffer, filesize);
+		printf("ERROR: Opening report file failed\n");
+
+		return(-3);
+	}
+	setvbuf(f, NULL, _IOFBF, ANALYSIS_BUFFER);
+
+	fprintf(f, "{\"file\":");
+	json_string(f, infile, strlen(infile));
+	fprintf(f, ",\"size\":%llu,\"rules\":\"%s\",\"slices\":[", (unsigned long long) filesize,
+			patcher_variant);
+	if ((buffer[0] == 0xCA) && (buffer[1] == 0xFE) && (buffer[2] == 0xBA) && (buffer[3] == 0xBE)) {
+		total_bins = OSSwapInt32(((struct fat_header *) buffer)->nfat_arch);
+		for (n = 0; n < total_bins; n++) {
+			if (sizeof(struct fat_header) + (n + 1) * sizeof(struct fat_arch) > filesize)
+				break;
+			memcpy(&arch, buffer + sizeof(struct fat_header) + n * sizeof(struct fat_arch),
+					sizeof(arch));
+			arch.cputype = OSSwapInt32(arch.cputype);
+			arch.offset = OSSwapInt32(arch.offset);
+			arch.size = OSSwapInt32(arch.size);
+			if (((arch.cputype != CPU_TYPE_X86_64) && (arch.cputype != CPU_TYPE_I386)) ||
+					((uint64_t) arch.offset + arch.size > filesize))
+				continue;
+			analyze_slice(f, buffer + arch.offset, arch.size, arch.offset, arch.cputype,
+					first);
+			first = FALSE;
+		}
+	} else
+		analyze_slice(f, buffer, filesize, 0,
+				(buffer[0] == 0xCF) ? CPU_TYPE_X86_64 : CPU_TYPE_I386, TRUE);
+	fprintf(f, "]}\n");
+
+	if (ferror(f) || ((f == stdout) ? (fflush(f) != 0) : (fclose(f) != 0)))
+	{
+		printf("ERROR: Writing report file failed\n");
+		ret = -3;
+	}
+	munmap(buffer, filesize);
+
+	return(ret);
+}
+#endif
+
+#ifndef CODESIGSTRIP
+/* --rule-file <file>: adds the user rules of the file (see add_user_rule), one per line:
+ *
+ *	<name> <start|whole> <pattern bytes> = <replacement bytes>
+ *
+ * a pattern byte is hh, hh/mm (the bits of mm must match hh) or ?? (any byte).  a
+ * replacement byte is hh, hh/mm (sets the bits of mm to those of hh, keeps the others) or ..
+ * (keeps the byte).  both sides have the same number of bytes.  a rule matches within one
+ * instruction: start rules at the start of any instruction at least as long as the pattern,
+ * whole rules only if the pattern also ends where the instruction does.
+ * empty lines and lines starting with # are ignored. */
+
+static boolean_t parse_rule_byte(const char *tok, const char *any, uint8_t *value,
+		uint8_t *mask)
+{
+	unsigned int v, m;
+	int len;
+
+	if (!strcmp(tok, any)) {
+		*value = *mask = 0;
+		return TRUE;
+	}
+	if ((sscanf(tok, "%2x%n", &v, &len) == 1) && (len == 2) && !tok[2]) {
+		*value = v;
+		*mask = 0xff;
+		return TRUE;
+	}
+	if ((sscanf(tok, "%2x/%2x%n", &v, &m, &len) == 2) && (len == 5) && !tok[5]) {
+		*value = v;
+		*mask = m;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static boolean_t parse_rule_line(char *line, struct user_rule *rule)
+{
+	char *tok, *save;
+	uint32_t n, len = 0;
+	boolean_t replacement = FALSE;
+
+	memset(rule, 0, sizeof(struct user_rule));
+	tok = strtok_r(line, " \t\r\n", &save);
+	if (!tok || (strlen(tok) >= sizeof(rule->name)) ||
+			(strspn(tok, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-")
+			 != strlen(tok)))
+		return FALSE;
+	strcpy(rule->name, tok);
+
+	tok = strtok_r(NULL, " \t\r\n", &save);
+	if (tok && !strcmp(tok, "start"))
+		rule->boundary = USER_RULE_START;
+	else if (tok && !strcmp(tok, "whole"))
+		rule->boundary = USER_RULE_WHOLE;
+	else
+		return FALSE;
+
+	for (n = 0; (tok = strtok_r(NULL, " \t\r\n", &save)); ) {
+		if (!strcmp(tok, "=") && !replacement) {
+			replacement = TRUE;
+			len = n;
+			n = 0;
+		} else if (n == USER_RULE_MAX_LEN) {
+			return FALSE;
+		} else if (!replacement) {
+			if (!parse_rule_byte(tok, "??", &rule->value[n], &rule->mask[n]))
+				return FALSE;
+			n++;
+		} else {
+			if (!parse_rule_byte(tok, "..", &rule->replace[n], &rule->keep[n]))
+				return FALSE;
+			rule->keep[n] = ~rule->keep[n];
+			n++;
+		}
+	}
+	if (!replacement || (n != len))
+		return FALSE;
+	rule->len = len;
+	return TRUE;
+}
+
+static boolean_t load_rule_file(const char *path)
+{
+	struct user_rule rule;
+	char line[1024], *p;
+	uint32_t num = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("ERROR: Opening rule file failed\n");
+		return FALSE;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		num++;
+		for (p = line; (*p == ' ') || (*p == '\t'); p++)
+			;
+		if (!*p || (*p == '#') || (*p == '\n') || (*p == '\r'))
+			continue;
+		if (!parse_rule_line(p, &rule) || !add_user_rule(&rule)) {
+			printf("ERROR: %s:%u: invalid rule (or too many)\n", path, num);
+			fclose(f);
+			return FALSE;
+		}
+	}
+	fclose(f);
+	return TRUE;
+}
+#endif
+
+static int stream_file(const char *infile, const char *outfile, boolean_t in_place,
+		struct file_report *rep);
+
+/* write_range: writes [off, end) of the mapping at buffer to the same offsets of fd */
+
+static boolean_t write_range(int fd, const uint8_t *buffer, uint64_t off, uint64_t end)
+{
+	ssize_t res;
+
+	for (; off < end; off += res) {
+		res = pwrite(fd, buffer + off, end - off, off);
+		if (res <= 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* write_changes: writes what was changed in the first size bytes of the private mapping at
+ * buffer to the output fd.  the journal holds every change, unless it failed or the images
+ * were compacted (which moves everything behind the signatures); then all of it is written. */
+
+static boolean_t write_changes(int fd, const uint8_t *buffer, uint64_t size,
+		const struct patch_journal *journal)
+{
+	const struct journal_extent *e;
+	uint32_t i;
+
+	if (journal->failed || compact_output)
+		return write_range(fd, buffer, 0, size);
+	for (i = 0; i < journal->num; i++) {
+		e = &journal->extents[i];
+		if ((e->off < size) && !write_range(fd, buffer, e->off, min(e->off + e->len, size)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* process_file: patches one file and strips its code signature(s).  returns 0 on success,
+ * -1 if the file is not a supported Mach-O file, -2 if it can't be opened and -3 if the
+ * output can't be written (these are also the exit codes of the tool). */
+
+static int process_file(const char *infile, const char *outfile, boolean_t in_place,
+		struct file_report *rep)
+{
+	int fd, out;
+	int ret = 0;
+	struct stat st;
+	uint8_t magic[4];
+	uint8_t *buffer;
+	struct fat_arch *archbin;
+	struct slice_job *jobs;
+	size_t filesize = 0;
+	uint32_t current_bin = 0;
+	uint32_t total_bins = 0;
+	uint32_t total_patches = 0;
+	boolean_t bypass = FALSE;
+	uint32_t num_patches = 0;
+	uint32_t num_bad = 0;
+#ifndef CODESIGSTRIP
+	kern_return_t result = KERN_SUCCESS;
+#endif
+	size_t outsize;
+	struct patch_report report = { NULL, 0 };
+	struct macho_image img;
+	struct patch_journal journal;
+
+	if (stream_mode)
+		return stream_file(infile, outfile, in_place, rep);
+
+	memset(rep, 0, sizeof(struct file_report));
+	memset(&img, 0, sizeof(struct macho_image));
+	memset(&journal, 0, sizeof(struct patch_journal));
+
+	/* the file is mapped rather than read: untouched pages are never copied.  in place, only
+	 * the pages dirtied by the patching routines are written back; otherwise the mapping is
+	 * private and the output gets the journaled changes (see write_changes). */
+	fd = open(infile, in_place ? O_RDWR : O_RDONLY);
+
+	if ((fd < 0) || (fstat(fd, &st) != 0))
+	{
+		if (fd >= 0)
+			close(fd);
+		printf("ERROR: Opening input file failed\n");
+
+		return(-2);
+	}
+
+	filesize = (size_t) st.st_size;
+	outsize = filesize;
+
+	if ((filesize < sizeof(struct mach_header)) || (pread(fd, magic, 4, 0) != 4) ||
+			!is_macho_file(magic))
+	{
+		close(fd);
+		msg("ERROR: Unsupported or no Mach-O file\n");
+
+		return(-1);
+	}
+
+	buffer = (uint8_t *) mmap(NULL, filesize, PROT_READ|PROT_WRITE,
+			in_place ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+
+	if (buffer == (uint8_t *) MAP_FAILED)
+	{
+		close(fd);
+		printf("ERROR: Mapping input file failed\n");
+
+		return(-2);
+	}
+
+	if (((buffer[0] == 0xCE) || (buffer[0] == 0xCF)) && (buffer[1] == 0xFA) && (buffer[2] == 0xED) && (buffer[3] == 0xFE)) // Mach-O 32/64bit
+	{
+		boolean_t is_64 = (buffer[0] == 0xCF);
+
+		macho_image_init(&img, buffer, filesize, is_64);
+		if (journal_path || !in_place)
+			img.journal = &journal;
+#ifndef CODESIGSTRIP
+		if (is_marked(&img))
+			msg("Already patched, skipping scan\n");
+		else
+			result = patch_image_cached(&img, is_64, VERBOSE, &bypass, &num_patches,
+					&num_bad, &report);
+		total_patches = num_patches;
+#else
+		total_patches = 1;
+#endif
+		remove_code_signature(&img);
+#ifndef CODESIGSTRIP
+		if ((result == KERN_SUCCESS) || bypass)
+			mark_image(&img);
+#endif
+		if (img.size < outsize)
+			outsize = img.size;
+	} else if ((buffer[0] == 0xCA) && (buffer[1] == 0xFE) && (buffer[2] == 0xBA) && (buffer[3] == 0xBE)) { // Universal Binary
+		total_bins = buffer[7] + (buffer[6] << 8) + (buffer[5] << 16) + (buffer[4] << 24);
+
+		msg("Patching universal binary (%d architectures)\n", total_bins);
+
+		archbin = (struct fat_arch *)(buffer + 8);
+		jobs = NULL;
+		if (sizeof(struct fat_header) + (uint64_t) total_bins * sizeof(struct fat_arch) > filesize)
+			printf("ERROR: Reading universal binary header failed\n");
+		else if (!(jobs = (struct slice_job *) calloc(total_bins ? total_bins : 1,
+						sizeof(struct slice_job))))
+			printf("ERROR: Out of memory\n");
+		for (current_bin = 0; jobs && (current_bin < total_bins); current_bin++)
+		{
+			if ((uint64_t) OSSwapInt32(archbin[current_bin].offset) +
+					OSSwapInt32(archbin[current_bin].size) > filesize)
+			{
+				printf("ERROR: Reading architecture %d failed\n", current_bin);
+				free(jobs);
+				jobs = NULL;
+			}
+		}
+		if (!jobs)
+		{
+			munmap(buffer, filesize);
+			close(fd);
+
+			return(-1);
+		}
+
+		for (current_bin = 0; current_bin < total_bins; current_bin++)
+		{
+			jobs[current_bin].cputype = OSSwapInt32(archbin[current_bin].cputype);
+			jobs[current_bin].data = buffer + OSSwapInt32(archbin[current_bin].offset);
+			jobs[current_bin].size = OSSwapInt32(archbin[current_bin].size);
+			if ((jobs[current_bin].cputype == CPU_TYPE_X86_64) ||
+					(jobs[current_bin].cputype == CPU_TYPE_I386))
+			{
+				macho_image_init(&jobs[current_bin].img, jobs[current_bin].data,
+						jobs[current_bin].size,
+						jobs[current_bin].cputype == CPU_TYPE_X86_64);
+				if (journal_path || !in_place)
+					jobs[current_bin].img.journal = &jobs[current_bin].journal;
+			}
+		}
+
+#ifndef CODESIGSTRIP
+		if (VERBOSE)
+		{
+			for (current_bin = 0; current_bin < total_bins; current_bin++)
+				patch_slice(jobs, current_bin);
+		} else {
+			parallel_for(total_bins, patch_slice, jobs);
+		}
+#endif
+
+		total_patches = finish_slices(jobs, total_bins, rep);
+
+		if (compact_output)
+			outsize = compact_fat(buffer, filesize, jobs, total_bins);
+
+		for (current_bin = 0; current_bin < total_bins; current_bin++)
+		{
+			journal_append(&journal, &jobs[current_bin].journal,
+					jobs[current_bin].data - buffer);
+			journal_free(&jobs[current_bin].journal);
+			free(jobs[current_bin].report.sections);
+			macho_image_free(&jobs[current_bin].img);
+		}
+		free(jobs);
+	}
+	else {
+		munmap(buffer, filesize);
+		close(fd);
+		msg("ERROR: Unsupported or no Mach-O file\n");
+
+		return(-1);
+	}
+
+	if (!in_place && (total_patches <= 0))
+	{
+		msg("No patches found, not generating output file");
+	}
+	else if (in_place)
+	{
+		/* the mapping is shared with the file, so only the dirty pages are written */
+		if ((msync(buffer, filesize, MS_SYNC) != 0) ||
+				((outsize < filesize) && (ftruncate(fd, outsize) != 0)))
+		{
+			printf("ERROR: Writing output file failed\n");
+			ret = -3;
+		} else
+			rep->written = TRUE;
+	}
+	else if ((out = create_output(fd, outfile, outsize)) < 0)
+	{
+		printf("ERROR: Opening output file failed\n");
+		ret = -3;
+	}
+	else
+	{
+		if (!write_changes(out, buffer, outsize, &journal) ||
+				((outsize < filesize) && (ftruncate(out, outsize) != 0)))
+			ret = -3;
+		if (close(out) != 0)
+			ret = -3;
+		if (ret != 0)
+		{
+			unlink(outfile);
+			printf("ERROR: Writing output file failed\n");
+		} else
+			rep->written = TRUE;
+	}
+
+	if (rep->written && journal_path && (save_journal(infile, &journal) != 0))
+	{
+		printf("ERROR: Writing journal failed\n");
+		ret = -3;
+	}
+
+	if ((ret == 0) && !((buffer[0] == 0xCA) && (buffer[1] == 0xFE) && (buffer[2] == 0xBA) && (buffer[3] == 0xBE)))
+		report_image(&report, num_patches, num_bad, bypass, rep);
+
+	free(report.sections);
+	journal_free(&journal);
+	macho_image_free(&img);
+	munmap(buffer, filesize);
+	close(fd);
+
+	return(ret);
+}
+
+/* streaming mode: nothing is mapped and the file is never in memory as a whole, whatever its
+ * size.  only the headers and load commands are read up front; the code sections are swept
+ * through a window (see stream_code_section), linkedit data is read when it is needed and
+ * the code signatures are cleared in the file.  an output file is created as usual (see
+ * create_output) and patched with pwrite.  --compact is not supported, the signatures are
+ * zeroed instead. */
+
+/* stream_image_init: reads the header and the load commands of the image of size bytes at
+ * fileoff in fd and indexes them.  returns FALSE if they can't be read. */
+
+static boolean_t stream_image_init(struct macho_image *img, int fd, uint64_t fileoff,
+		uint64_t size, boolean_t is_64)
+{
+	struct mach_header mh;
+	uint64_t loaded;
+	uint8_t *base;
+
+	memset(img, 0, sizeof(struct macho_image));
+	img->fd = -1;
+	if ((size < sizeof(mh)) || (pread(fd, &mh, sizeof(mh), fileoff) != sizeof(mh)))
+		return FALSE;
+	loaded = min((is_64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header)) +
+			(uint64_t) mh.sizeofcmds, size);
+	base = malloc(loaded);
+	if (!base)
+		return FALSE;
+	if ((pread(fd, base, loaded, fileoff) != (ssize_t) loaded) ||
+			!macho_image_init(img, base, loaded, is_64)) {
+		macho_image_free(img);
+		free(base);
+		img->base = NULL;
+		return FALSE;
+	}
+	img->size = size;
+	img->fd = fd;
+	img->fileoff = fileoff;
+	img->loaded = loaded;
+	return TRUE;
+}
+
+/* stream_image_free: frees a streamed image (its changes are already written, see
+ * macho_store) */
 
-/* note: the map_addr and map_size arguments are used only for error checking. */
+static void stream_image_free(struct macho_image *img)
+{
+	free(img->base);
+	img->base = NULL;
+	macho_image_free(img);
+}
 
-kern_return_t patch_text_segment(uint8_t *addr, __unused mach_vm_offset_t map_addr,
-		mach_vm_size_t map_size, boolean_t abi_is_64, boolean_t seg_is_64,
-		boolean_t verbose, boolean_t *bypass, uint32_t *num_patches_out,
-		uint32_t *num_bad_out)
+static int stream_file(const char *infile, const char *outfile, boolean_t in_place,
+		struct file_report *rep)
 {
-	uint64_t text_addr, text_size;
-	uint32_t text_offset;
-	uint8_t *text_data;
-	uint64_t tmp_size;
-	uint32_t num_patches, num_bad;
+	int in, fd;
+	struct stat st;
+	uint8_t magic[8];
+	uint64_t filesize;
+	struct fat_arch *archbin;
+	struct slice_job *jobs;
+	uint32_t current_bin;
+	uint32_t total_bins = 0;
+	uint32_t total_patches = 0;
+	boolean_t bypass = FALSE;
+	uint32_t num_patches = 0;
+	uint32_t num_bad = 0;
+#ifndef CODESIGSTRIP
+	kern_return_t result = KERN_SUCCESS;
+#endif
+	struct patch_report report = { NULL, 0 };
+	struct macho_image img;
+	struct patch_journal journal;
+	struct image_output out;
+	boolean_t ok = TRUE, read_ok = TRUE;
+	int ret = 0;
+
+	memset(rep, 0, sizeof(struct file_report));
+	memset(&journal, 0, sizeof(struct patch_journal));
+
+	in = open(infile, in_place ? O_RDWR : O_RDONLY);
+	if ((in < 0) || (fstat(in, &st) != 0))
+	{
+		if (in >= 0)
+			close(in);
+		printf("ERROR: Opening input file failed\n");
 
-	*bypass = FALSE;
+		return(-2);
+	}
+	filesize = (uint64_t) st.st_size;
 
-	if (seg_is_64) {
-		struct section_64 *text_sect;
-		text_sect = getsectforpatch_64((struct mach_header_64 *) addr, "__TEXT", "__text");
-		if (!text_sect) {
-			if (verbose)
-				printf("getsectforpatch_64 failed (text segment appears "
-						"to contain garbage, bypassing patcher)\n");
-			*bypass = TRUE;
-			return KERN_FAILURE;
+	if ((filesize < sizeof(struct mach_header)) || (pread(in, magic, 8, 0) != 8) ||
+			!is_macho_file(magic))
+	{
+		close(in);
+		msg("ERROR: Unsupported or no Mach-O file\n");
+
+		return(-1);
+	}
+
+	/* without --in-place, the images read the input until their first write creates the
+	 * output (see image_output) */
+	fd = in;
+	memset(&out, 0, sizeof(out));
+	pthread_mutex_init(&out.lock, NULL);
+	out.in = in;
+	out.path = outfile;
+	out.size = filesize;
+	out.fd = -1;
+
+	if (magic[0] != 0xCA) // Mach-O 32/64bit
+	{
+		boolean_t is_64 = (magic[0] == 0xCF);
+
+		if (!stream_image_init(&img, fd, 0, filesize, is_64))
+		{
+			read_ok = FALSE;
+		} else {
+			if (!in_place)
+				img.output = &out;
+			if (journal_path)
+				img.journal = &journal;
+#ifndef CODESIGSTRIP
+			if (is_marked(&img))
+				msg("Already patched, skipping scan\n");
+			else
+				result = patch_image_cached(&img, is_64, VERBOSE, &bypass,
+						&num_patches, &num_bad, &report);
+			total_patches = num_patches;
+#else
+			total_patches = 1;
+#endif
+			/* the output is dropped if nothing was patched, so don't create it */
+			if (total_patches <= 0)
+				out.discard = TRUE;
+			remove_code_signature(&img);
+#ifndef CODESIGSTRIP
+			if ((result == KERN_SUCCESS) || bypass)
+				mark_image(&img);
+#endif
+			if (img.read_error)
+				read_ok = FALSE;
+			else if (img.io_error)
+				ok = FALSE;
+			stream_image_free(&img);
 		}
-		text_addr = text_sect->addr;
-		text_size = text_sect->size;
-		text_offset = text_sect->offset;
-	} else {
-		struct section *text_sect;
-		text_sect = getsectforpatch((struct mach_header *) addr, "__TEXT", "__text");
-		if (!text_sect) {
-			if (verbose)
-				printf("getsectforpatch failed (text segment appears "
-						"to contain garbage, bypassing patcher)\n");
-			*bypass = TRUE;
-			return KERN_FAILURE;
+	} else { // Universal Binary
+		total_bins = magic[7] + (magic[6] << 8) + (magic[5] << 16) + (magic[4] << 24);
+
+		msg("Patching universal binary (%d architectures)\n", total_bins);
+
+		archbin = calloc(total_bins ? total_bins : 1, sizeof(struct fat_arch));
+		jobs = calloc(total_bins ? total_bins : 1, sizeof(struct slice_job));
+		if (!archbin || !jobs || (sizeof(struct fat_header) +
+					(uint64_t) total_bins * sizeof(struct fat_arch) > filesize) ||
+				(pread(fd, archbin, total_bins * sizeof(struct fat_arch),
+				       sizeof(struct fat_header)) !=
+				 (ssize_t) (total_bins * sizeof(struct fat_arch))))
+			total_bins = 0, read_ok = FALSE;
+
+		for (current_bin = 0; current_bin < total_bins; current_bin++)
+		{
+			struct slice_job *job = &jobs[current_bin];
+			uint64_t offset = OSSwapInt32(archbin[current_bin].offset);
+
+			job->cputype = OSSwapInt32(archbin[current_bin].cputype);
+			job->size = OSSwapInt32(archbin[current_bin].size);
+			if ((job->cputype != CPU_TYPE_X86_64) && (job->cputype != CPU_TYPE_I386))
+				continue;
+			if ((offset + job->size > filesize) || !stream_image_init(&job->img, fd,
+						offset, job->size, job->cputype == CPU_TYPE_X86_64))
+			{
+				printf("ERROR: Reading architecture %d failed\n", current_bin);
+				job->cputype = 0;
+				read_ok = FALSE;
+			} else {
+				if (!in_place)
+					job->img.output = &out;
+				if (journal_path)
+					job->img.journal = &job->journal;
+			}
 		}
-		text_addr = (uint64_t) text_sect->addr;
-		text_size = (uint64_t) text_sect->size;
-		text_offset = text_sect->offset;
-	}
 
-	tmp_size = (uint64_t) text_offset + text_size;
-#ifdef FIXME
-	/* xxx: this check only makes sense if map_addr is guaranteed to be vmaddr */
-	if ((text_addr - map_addr) > map_size) {
-		printf("text section address not within mapped range\n");
-		return KERN_FAILURE;
-	} else
+#ifndef CODESIGSTRIP
+		if (VERBOSE)
+		{
+			for (current_bin = 0; current_bin < total_bins; current_bin++)
+				patch_slice(jobs, current_bin);
+		} else {
+			parallel_for(total_bins, patch_slice, jobs);
+		}
 #endif
-	if (tmp_size > map_size) {
-		printf("text section offset and size greater than mapping size\n");
-		return KERN_FAILURE;
-	} else if ((tmp_size + 16) > map_size) {
-		/* take care not to access anything beyond the mapped range if the text
-		 * section ends within 16 bytes (maximum instruction length is 15 bytes)
-		 * of the end */
-		text_size -= 16 - (map_size - tmp_size);
-	}
 
-	text_data = (uint8_t *) addr + text_offset;
+#ifndef CODESIGSTRIP
+		for (current_bin = 0; current_bin < total_bins; current_bin++)
+			if (jobs[current_bin].num_patches)
+				break;
+		if (current_bin == total_bins)
+			out.discard = TRUE;
+#endif
+		total_patches = finish_slices(jobs, total_bins, rep);
 
-	if (verbose) {
-		uint32_t n;
-		for (n = 0; n < 16; n++)
-			printf("%02x ", text_data[n]);
-		printf("\n");
+		for (current_bin = 0; current_bin < total_bins; current_bin++)
+		{
+			free(jobs[current_bin].report.sections);
+			journal_append(&journal, &jobs[current_bin].journal,
+					jobs[current_bin].img.fileoff);
+			journal_free(&jobs[current_bin].journal);
+			if (!jobs[current_bin].img.base)
+				continue;
+			if (jobs[current_bin].img.read_error)
+				read_ok = FALSE;
+			else if (jobs[current_bin].img.io_error)
+				ok = FALSE;
+			stream_image_free(&jobs[current_bin].img);
+		}
+		free(archbin);
+		free(jobs);
 	}
 
-	/* before attempting to patch anything, scan through some of the section and verify
-	 * that what we are attempting to patch is not total garbage. */
-	num_bad = scan_text_section(text_data, min(text_size, PRESCAN_SIZE), text_addr, FALSE,
-			abi_is_64, verbose, &num_patches);
-	if (verbose)
-		printf("prescan found %d bad instructions\n", num_bad);
-	if (num_bad >= PRESCAN_MAX_BAD) {
-		if (verbose)
-			printf("text section appears to contain garbage, bypassing patcher\n");
-		*bypass = TRUE;
-		return KERN_FAILURE;
+	/* an output with nothing written to it is still a copy (--codesigstrip) */
+	if (!in_place && read_ok && ok && (total_patches > 0) && (image_output_fd(&out) < 0))
+		ok = FALSE;
+	if ((out.fd >= 0) && (close(out.fd) != 0))
+		ok = FALSE;
+	if (close(fd) != 0)
+		ok = FALSE;
+	pthread_mutex_destroy(&out.lock);
+
+	if (!read_ok || !ok)
+	{
+		if (out.fd >= 0)
+			unlink(outfile);
+		if (!read_ok)
+		{
+			printf("ERROR: Reading input file failed\n");
+			ret = -2;
+		} else if (out.failed) {
+			printf("ERROR: Opening output file failed\n");
+			ret = -3;
+		} else {
+			printf("ERROR: Writing output file failed\n");
+			ret = -3;
+		}
+	} else if (!in_place && (total_patches <= 0)) {
+		if (out.fd >= 0)
+			unlink(outfile);
+		msg("No patches found, not generating output file");
+	} else
+		rep->written = TRUE;
+
+	if (rep->written && journal_path && (save_journal(infile, &journal) != 0))
+	{
+		printf("ERROR: Writing journal failed\n");
+		ret = -3;
 	}
 
-	/* now that we have decided the text section contains valid code, scan through the
-	 * whole section and perform the actual patching. */
-	num_bad = scan_text_section(text_data, text_size, text_addr, TRUE, abi_is_64, verbose,
-			&num_patches);
-	if (verbose)
-		printf("complete scan found %d bad instructions\n", num_bad);
+	if ((ret == 0) && (magic[0] != 0xCA))
+		report_image(&report, num_patches, num_bad, bypass, rep);
 
-	*num_patches_out = num_patches;
-	*num_bad_out = num_bad;
+	free(report.sections);
+	journal_free(&journal);
 
-	return KERN_SUCCESS;
+	return(ret);
 }
 
-kern_return_t remove_code_signature_32(uint8_t *data)
+/* batch mode: the files of a list or a directory tree are processed by one worker per
+ * processor.  every worker starts with a contiguous range of the file list and, once that
+ * is used up, steals the upper half of the range of another worker.  per-file messages are
+ * suppressed; only errors and one aggregated report are printed. */
+
+struct batch_range {
+	pthread_mutex_t lock;
+	uint32_t head, tail;
+};
+
+struct batch_worker {
+	struct batch_range range;
+	uint32_t num_files, num_written, num_skipped, num_failed;
+	uint32_t num_patches, num_bad, num_bypassed;
+};
+
+struct batch {
+	char **files; // input paths
+	char **rel; // paths relative to the output root
+	uint32_t num_files, max_files;
+	const char *root;
+	const char *outroot;
+	boolean_t in_place;
+	struct batch_worker *workers;
+	uint32_t num_workers;
+};
+
+/* rel_leaves_root: whether the relative path rel has a ".." component, which could take the
+ * output out of the output root (or onto the input itself) */
+
+static boolean_t rel_leaves_root(const char *rel)
 {
-	struct mach_header *mh_32 = (struct mach_header *)data;
-	struct load_command *tmplc = (struct load_command *)(data + sizeof(struct mach_header));
-	uint32_t curlc = 0;
-	uint32_t totlc = mh_32->ncmds;
-	uint32_t curoff = sizeof(struct mach_header);
-	struct linkedit_data_command *cryptsiglc = (struct linkedit_data_command *)0;
-    struct linkedit_data_command *cryptsigdrs = (struct linkedit_data_command *)0;
-	uint8_t *cryptsigdata = (uint8_t *)0;
-    uint8_t *cryptdrsdata = (uint8_t *)0;
-	uint32_t cryptsigdatasize = 0;
-	uint32_t zeroeddata = 0;
+	const char *p;
 
-	/* Get code signature load command + divide */
-	while (curlc < totlc)
-	{
-		if (tmplc->cmd == LC_CODE_SIGNATURE)
-		{
-			cryptsiglc = (struct linkedit_data_command *)(data + curoff);
-		}
+	for (p = rel; *p; p++) {
+		if (((p == rel) || (p[-1] == '/')) && (p[0] == '.') && (p[1] == '.') &&
+				((p[2] == '/') || !p[2]))
+			return TRUE;
+	}
+	return FALSE;
+}
 
-        if (tmplc->cmd == LC_DYLIB_CODE_SIGN_DRS)
-        {
-            cryptsigdrs = (struct linkedit_data_command *)(data + curoff);
-        }
+/* batch_add: adds path to the batch; its output goes to rel under the output root.  rel is
+ * left NULL if it would leave the output root, and the file is then skipped. */
 
-		curoff += tmplc->cmdsize;
-		tmplc = (struct load_command *)(data + curoff);
-		++curlc;
+static int batch_add(struct batch *b, const char *path, const char *rel)
+{
+	if (b->num_files == b->max_files) {
+		char **files, **rels;
+		uint32_t max = b->max_files ? b->max_files * 2 : 1024;
+		files = realloc(b->files, max * sizeof(char *));
+		if (files)
+			b->files = files;
+		rels = realloc(b->rel, max * sizeof(char *));
+		if (rels)
+			b->rel = rels;
+		if (!files || !rels)
+			return -1;
+		b->max_files = max;
 	}
+	while (*rel == '/')
+		rel++;
+	b->files[b->num_files] = strdup(path);
+	b->rel[b->num_files] = NULL;
+	if (!b->files[b->num_files])
+		return -1;
+	if (b->in_place || !rel_leaves_root(rel)) {
+		b->rel[b->num_files] = strdup(rel);
+		if (!b->rel[b->num_files])
+			return -1;
+	}
+	b->num_files++;
+	return 0;
+}
 
-	/* Safety check */
-	if ((cryptsiglc == 0) && (cryptsigdrs == 0))
-	{
-		printf("No code signature found, skipping patch\n");
-		return KERN_FAILURE;
+static int batch_walk(struct batch *b, const char *dir)
+{
+	DIR *d;
+	struct dirent *ent;
+	struct stat st;
+	char *path;
+	int ret = 0;
+
+	d = opendir(dir);
+	if (!d)
+		return -1;
+	while (!ret && (ent = readdir(d))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		path = malloc(strlen(dir) + strlen(ent->d_name) + 2);
+		if (!path) {
+			ret = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", dir, ent->d_name);
+		if (lstat(path, &st) == 0) {
+			if (S_ISDIR(st.st_mode))
+				ret = batch_walk(b, path);
+			else if (S_ISREG(st.st_mode))
+				ret = batch_add(b, path, path + strlen(b->root));
+		}
+		free(path);
 	}
+	closedir(d);
+	return ret;
+}
+
+static int batch_collect(struct batch *b, const char *source)
+{
+	struct stat st;
+	FILE *list;
+	char line[4096];
+	size_t len;
 
-    if (cryptsiglc)
-    {
-        cryptsigdata = (uint8_t *)(data + cryptsiglc->dataoff);
-
-        zeroeddata = 0;
-
-        /* Zero code signature... */
-        while (zeroeddata < cryptsiglc->datasize)
-        {
-            *cryptsigdata = 0;
-            ++zeroeddata;
-            ++cryptsigdata;
-        }
-
-        /* Reduce the number of load commands + load command size */
-        mh_32->ncmds -= 1;
-        mh_32->sizeofcmds -= cryptsiglc->cmdsize;
-
-    	/* Zero out load command of LC_CODE_SIGNATURE */
-        cryptsiglc->cmd = 0;
-        cryptsiglc->cmdsize = 0;
-        cryptsiglc->dataoff = 0;
-        cryptsiglc->datasize = 0;
-
-        printf("Code signature (SIG) removed succesfully (32bit)\n");
-    }
-
-    if (cryptsigdrs)
-    {
-        cryptdrsdata = (uint8_t *)(data + cryptsigdrs->dataoff);
-
-        zeroeddata = 0;
-
-        /* Zero code signature... */
-        while (zeroeddata < cryptsigdrs->datasize)
-        {
-            *cryptdrsdata = 0;
-            ++zeroeddata;
-            ++cryptdrsdata;
-        }
-
-        /* Reduce the number of load commands + load command size */
-        mh_32->ncmds -= 1;
-        mh_32->sizeofcmds -= cryptsigdrs->cmdsize;
-        
-        /* Zero out load command of LC_CODE_SIGNATURE */
-        cryptsigdrs->cmd = 0;
-        cryptsigdrs->cmdsize = 0;
-        cryptsigdrs->dataoff = 0;
-        cryptsigdrs->datasize = 0;
-
-    	printf("Code signature (DRS) removed succesfully (32bit)\n");
-    }
+	if (stat(source, &st) != 0)
+		return -1;
 
-	return KERN_SUCCESS;
+	if (S_ISDIR(st.st_mode)) {
+		b->root = source;
+		return batch_walk(b, source);
+	}
+
+	list = fopen(source, "r");
+	if (!list)
+		return -1;
+	while (fgets(line, sizeof(line), list)) {
+		len = strlen(line);
+		while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+			line[--len] = 0;
+		if (len && (batch_add(b, line, line) != 0)) {
+			fclose(list);
+			return -1;
+		}
+	}
+	fclose(list);
+	return 0;
 }
 
-kern_return_t remove_code_signature_64(uint8_t *data)
+/* make_parent_dirs: creates the missing directories leading up to path */
+
+static int make_parent_dirs(char *path)
 {
-	struct mach_header_64 *mh_64 = (struct mach_header_64 *)data;
-	struct load_command *tmplc = (struct load_command *)(data + sizeof(struct mach_header_64));
-	uint32_t curlc = 0;
-	uint32_t totlc = mh_64->ncmds;
-	uint32_t curoff = sizeof(struct mach_header_64);
-	struct linkedit_data_command *cryptsiglc = (struct linkedit_data_command *)0;
-    struct linkedit_data_command *cryptsigdrs = (struct linkedit_data_command *)0;
-	uint8_t *cryptsigdata = (uint8_t *)0;
-    uint8_t *cryptdrsdata = (uint8_t *)0;
-	uint32_t cryptsigdatasize = 0;
-	uint32_t zeroeddata = 0;
-	
-       /* Get code signature load command + divide */
-        while (curlc < totlc)
-        {
-                if (tmplc->cmd == LC_CODE_SIGNATURE)
-                {
-                        cryptsiglc = (struct linkedit_data_command *)(data + curoff);
-                }
-
-            if (tmplc->cmd == LC_DYLIB_CODE_SIGN_DRS)
-            {
-                cryptsigdrs = (struct linkedit_data_command *)(data + curoff);
-            }
-            
-
-                curoff += tmplc->cmdsize;
-                tmplc = (struct load_command *)(data + curoff);
-                ++curlc;
-        }
+	char *p;
 
-	/* Safety check */
-	if ((cryptsiglc == 0) && (cryptsigdrs == 0))
-	{
-		printf("No code signature found, skipping patch\n");
-		return KERN_FAILURE;
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		if ((mkdir(path, 0777) != 0) && (errno != EEXIST)) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
 	}
-
-    if (cryptsiglc)
-    {
-        cryptsigdata = (uint8_t *)(data + cryptsiglc->dataoff);
-	
-        /* Zero code signature... */
-        while (zeroeddata < cryptsiglc->datasize)
-        {
-            *cryptsigdata = 0;
-            ++zeroeddata;
-            ++cryptsigdata;
-        }
-	
-        /* Reduce the number of load commands + load command size */
-        mh_64->ncmds -= 1;
-        mh_64->sizeofcmds -= cryptsiglc->cmdsize;
-	
-        /* Zero out load command of LC_CODE_SIGNATURE */
-        cryptsiglc->cmd = 0;
-        cryptsiglc->cmdsize = 0;
-        cryptsiglc->dataoff = 0;
-        cryptsiglc->datasize = 0;
-	
-        printf("Code signature (SIG) removed succesfully (64bit)\n");
-    }
-
-    if (cryptsigdrs)
-    {
-        cryptdrsdata = (uint8_t *)(data + cryptsigdrs->dataoff);
-        
-        zeroeddata = 0;
-        
-        /* Zero code signature... */
-        while (zeroeddata < cryptsigdrs->datasize)
-        {
-            *cryptdrsdata = 0;
-            ++zeroeddata;
-            ++cryptdrsdata;
-        }
-        
-        /* Reduce the number of load commands + load command size */
-        mh_64->ncmds -= 1;
-        mh_64->sizeofcmds -= cryptsigdrs->cmdsize;
-        
-        /* Zero out load command of LC_CODE_SIGNATURE */
-        cryptsigdrs->cmd = 0;
-        cryptsigdrs->cmdsize = 0;
-        cryptsigdrs->dataoff = 0;
-        cryptsigdrs->datasize = 0;
-        
-    	printf("Code signature (DRS) removed succesfully (64bit)\n");
-    }
-    
-	return KERN_SUCCESS;
+	return 0;
 }
 
-void Usage(char *name)
+static boolean_t batch_next(struct batch *b, uint32_t self, uint32_t *file)
 {
-	printf("AnV Mach-O AMD Instruction Patcher V1.03\n");
-	printf("Usage: %s <infile> <outfile>\n", name);
-#ifdef EXTENDED_PATCHER
-	printf("Patcher: Extended\n");
-#else
-	printf("Patcher: Standard\n");
-#endif
-	printf("Code signature stripping code also included\n");
-	printf("Copyright (C) 2010 AnV Software\n");
-	printf("Patching routines made by Voodoo team and extended by AnV Software\n");
+	struct batch_range *own = &b->workers[self].range;
+	struct batch_range *victim;
+	uint32_t n, head, mid, tail;
+
+	pthread_mutex_lock(&own->lock);
+	if (own->head < own->tail) {
+		*file = own->head++;
+		pthread_mutex_unlock(&own->lock);
+		return TRUE;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	for (n = 1; n < b->num_workers; n++) {
+		victim = &b->workers[(self + n) % b->num_workers].range;
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head >= victim->tail) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+		head = victim->head;
+		tail = victim->tail;
+		mid = tail - (tail - head + 1) / 2;
+		victim->tail = mid;
+		pthread_mutex_unlock(&victim->lock);
+
+		*file = mid;
+		pthread_mutex_lock(&own->lock);
+		own->head = mid + 1;
+		own->tail = tail;
+		pthread_mutex_unlock(&own->lock);
+		return TRUE;
+	}
+	return FALSE;
 }
 
-int main(int argc, char **argv)
+static void batch_work(void *ctx, uint32_t self)
 {
-	FILE *f;
-	uint8_t *buffer;
-	uint8_t *archbuffer;
-	struct fat_header *univbin;
-	struct fat_arch *archbin;
-	int filesize = 0;
-	uint32_t current_bin = 0;
-	uint32_t total_bins = 0;
-	uint32_t total_patches = 0;
-	boolean_t bypass = FALSE;
-	uint32_t num_patches = 0;
-	uint32_t num_bad = 0;
+	struct batch *b = ctx;
+	struct batch_worker *w = &b->workers[self];
+	struct file_report rep;
+	uint32_t file;
+	char *out;
+	int res;
+
+	while (batch_next(b, self, &file)) {
+		w->num_files++;
+		if (b->in_place) {
+			out = b->files[file];
+		} else if (!b->rel[file]) {
+			printf("ERROR: %s: path leads outside of the output directory, skipped\n",
+					b->files[file]);
+			w->num_skipped++;
+			continue;
+		} else {
+			out = malloc(strlen(b->outroot) + strlen(b->rel[file]) + 2);
+			if (!out) {
+				w->num_failed++;
+				continue;
+			}
+			sprintf(out, "%s/%s", b->outroot, b->rel[file]);
+			if (make_parent_dirs(out) != 0) {
+				printf("ERROR: %s: creating output directory failed\n", out);
+				free(out);
+				w->num_failed++;
+				continue;
+			}
+		}
 
-	if (argc != 3)
-	{
-		Usage(argv[0]);
+		res = process_file(b->files[file], out, b->in_place, &rep);
+		if (res == -1) {
+			w->num_skipped++;
+		} else if (res != 0) {
+			printf("ERROR: %s: processing failed (%d)\n", b->files[file], res);
+			w->num_failed++;
+		} else {
+			if (rep.written)
+				w->num_written++;
+			w->num_patches += rep.num_patches;
+			w->num_bad += rep.num_bad;
+			w->num_bypassed += rep.num_bypassed;
+		}
 
-		return(1);
+		if (out != b->files[file])
+			free(out);
 	}
+}
+
+static int process_batch(const char *source, const char *outroot, boolean_t in_place)
+{
+	struct batch b;
+	struct batch_worker total;
+	uint32_t n;
 
-	f = fopen(argv[1], "rb");
+	memset(&b, 0, sizeof(b));
+	b.outroot = outroot;
+	b.in_place = in_place;
 
-	if (!f)
+	if (batch_collect(&b, source) != 0)
 	{
-		printf("ERROR: Opening input file failed\n");
+		printf("ERROR: Reading file list failed\n");
 
 		return(-2);
 	}
 
-	fseek(f,0,SEEK_END);
-	filesize = ftell(f);
-	fseek(f,0,SEEK_SET);
+	b.num_workers = min(thread_limit(), b.num_files);
+	if (!b.num_workers)
+		b.num_workers = 1;
+	b.workers = calloc(b.num_workers, sizeof(struct batch_worker));
+	if (!b.workers)
+		return(-2);
+	for (n = 0; n < b.num_workers; n++) {
+		pthread_mutex_init(&b.workers[n].range.lock, NULL);
+		b.workers[n].range.head = (uint64_t) b.num_files * n / b.num_workers;
+		b.workers[n].range.tail = (uint64_t) b.num_files * (n + 1) / b.num_workers;
+	}
 
-	buffer = (uint8_t *)malloc(filesize);
+	quiet = TRUE;
+	parallel_for(b.num_workers, batch_work, &b);
+	quiet = FALSE;
+
+	memset(&total, 0, sizeof(total));
+	for (n = 0; n < b.num_workers; n++) {
+		total.num_files += b.workers[n].num_files;
+		total.num_written += b.workers[n].num_written;
+		total.num_skipped += b.workers[n].num_skipped;
+		total.num_failed += b.workers[n].num_failed;
+		total.num_patches += b.workers[n].num_patches;
+		total.num_bad += b.workers[n].num_bad;
+		total.num_bypassed += b.workers[n].num_bypassed;
+		pthread_mutex_destroy(&b.workers[n].range.lock);
+	}
 
-	fread((char *)buffer,filesize,1,f);
+	printf("Batch report: %u files, %u written, %u skipped (no Mach-O or bad path), "
+			"%u failed\n", total.num_files, total.num_written, total.num_skipped,
+			total.num_failed);
+	printf("Patch report: %u instructions patched, %u bad instructions, patches bypassed: %u\n",
+			total.num_patches, total.num_bad, total.num_bypassed);
 
-	fclose(f);
+	for (n = 0; n < b.num_files; n++) {
+		free(b.files[n]);
+		free(b.rel[n]);
+	}
+	free(b.files);
+	free(b.rel);
+	free(b.workers);
 
-	if ((buffer[0] == 0xCE) && (buffer[1] == 0xFA) && (buffer[2] == 0xED) && (buffer[3] == 0xFE)) // Mach-O 32bit
-	{
-#ifndef CODESIGSTRIP
-		patch_text_segment(buffer, 0, filesize, FALSE, FALSE, VERBOSE, &bypass, &num_patches, &num_bad);
-		total_patches = num_patches;
-#else
-		total_patches = 1;
-#endif
-		remove_code_signature_32(buffer);
-	} else if ((buffer[0] == 0xCF) && (buffer[1] == 0xFA) && (buffer[2] == 0xED) && (buffer[3] == 0xFE)) { // Mach-O 64bit
-#ifndef CODESIGSTRIP
-		patch_text_segment(buffer, 0, filesize, TRUE, TRUE, VERBOSE, &bypass, &num_patches, &num_bad);
-		total_patches = num_patches;
-#else
-		total_patches = 1;
-#endif
-		remove_code_signature_64(buffer);
-	} else if ((buffer[0] == 0xCA) && (buffer[1] == 0xFE) && (buffer[2] == 0xBA) && (buffer[3] == 0xBE)) { // Universal Binary
-		total_bins = buffer[7] + (buffer[6] << 8) + (buffer[5] << 16) + (buffer[4] << 24);
+	return(total.num_failed ? -3 : 0);
+}
 
-		printf ("Patching universal binary (%d architectures)\n", total_bins);
+int main(int argc, char **argv)
+{
+	struct file_report rep;
+	boolean_t in_place = FALSE;
+	boolean_t batch = FALSE;
+	int argi;
 
-		archbin = (struct fat_arch *)(buffer + 8);
-	
-		while (current_bin != total_bins)
+	for (argi = 1; argi < argc; argi++)
+	{
+		if (!strcmp(argv[argi], "--in-place"))
+			in_place = TRUE;
+		else if (!strcmp(argv[argi], "--batch"))
+			batch = TRUE;
+		else if (!strcmp(argv[argi], "--sparse"))
+			sparse_scan = TRUE;
+		else if (!strcmp(argv[argi], "--linear"))
+			linear_scan = TRUE;
+		else if (!strcmp(argv[argi], "--compact"))
+			compact_output = TRUE;
+		else if (!strcmp(argv[argi], "--stream"))
+			stream_mode = TRUE;
+		else if (!strcmp(argv[argi], "--journal") && (argi + 1 < argc))
+			journal_path = argv[++argi];
+		else if (!strcmp(argv[argi], "--cache") && (argi + 1 < argc))
+			cache_dir = argv[++argi];
+#ifndef CODESIGSTRIP
+		else if (!strcmp(argv[argi], "--analyze") && (argi + 1 < argc))
+			analyze_path = argv[++argi];
+		else if (!strcmp(argv[argi], "--mark"))
+			mark_output = TRUE;
+		else if (!strcmp(argv[argi], "--rules") && (argi + 1 < argc))
 		{
-			if (OSSwapInt32(archbin->cputype) == CPU_TYPE_X86_64)
+			uint32_t rules;
+
+			if (!parse_patch_rules(argv[++argi], &rules))
 			{
-				printf("Patching X86_64 part (processor %u, architecture %d)\n", OSSwapInt32(archbin->cputype), current_bin);
+				printf("ERROR: Unknown patch rule in %s\n", argv[argi]);
 
-				archbuffer = buffer + OSSwapInt32(archbin->offset);
-#ifndef CODESIGSTRIP
-				patch_text_segment(archbuffer, 0, OSSwapInt32(archbin->size), TRUE, TRUE, VERBOSE, &bypass, &num_patches, &num_bad);
-				total_patches += num_patches;
-#else
-				total_patches = 1;
+				return(1);
+			}
+			select_patch_rules(rules);
+		}
+		else if (!strcmp(argv[argi], "--rule-file") && (argi + 1 < argc))
+		{
+			if (!load_rule_file(argv[++argi]))
+				return(1);
+		}
 #endif
-				remove_code_signature_64(archbuffer);
+		else
+			break;
+	}
 
-				printf("Patch report (%d): %u instructions patched, %u bad instructions, patches bypassed: %s\n", current_bin+1, num_patches, num_bad, bypass == TRUE ? "YES" : "NO");
-			} else if (OSSwapInt32(archbin->cputype) == CPU_TYPE_I386) {
-				printf("Patching I386 part (processor %u, architecture %d)\n", OSSwapInt32(archbin->cputype), current_bin);
-				
-				archbuffer = buffer + OSSwapInt32(archbin->offset);
 #ifndef CODESIGSTRIP
-				patch_text_segment(archbuffer, 0, OSSwapInt32(archbin->size), FALSE, FALSE, VERBOSE, &bypass, &num_patches, &num_bad);
-				total_patches += num_patches;
-#else
-				total_patches = 1;
+	init_patcher_variant();
 #endif
 
-				remove_code_signature_32(archbuffer);
+#ifndef CODESIGSTRIP
+	/* the analysis writes nothing but the report and sweeps everything, as patching does
+	 * without --sparse */
+	if (analyze_path)
+	{
+		if ((argc - argi) != 1)
+		{
+			Usage(argv[0]);
 
-				printf("Patch report (%d): %u instructions patched, %u bad instructions, patches bypassed: %s\n", current_bin+1, num_patches, num_bad, bypass == TRUE ? "YES" : "NO");
-			} else {
-				printf("Skipping non-Intel architecture (%d)\n", current_bin);
-			}
+			return(1);
+		}
+		if (in_place || batch || sparse_scan || compact_output || stream_mode ||
+				journal_path || cache_dir || mark_output)
+		{
+			printf("ERROR: --analyze can only be combined with --linear, --rules and "
+					"--rule-file\n");
 
-			++current_bin;
-			++archbin;
+			return(1);
 		}
+		init_insn_length_table(TRUE);
+
+		return analyze_file(argv[argi]);
 	}
-	else {
-		printf("ERROR: Unsupported or no Mach-O file\n");
+#endif
 
-		return(-1);
+	if ((argc - argi) != (in_place ? 1 : 2))
+	{
+		Usage(argv[0]);
+
+		return(1);
 	}
 
-	if (total_patches <= 0)
+	/* the journal records changes in place; it can't describe slices that move or a
+	 * journal per file of a batch */
+	if (journal_path && (batch || compact_output))
 	{
-		printf("No patches found, not generating output file");
-	} else {
-		f = fopen(argv[2], "wb");
+		printf("ERROR: --journal can't be combined with --batch or --compact\n");
+
+		return(1);
+	}
 
-        if (!f)
-        {
-                printf("ERROR: Opening output file failed\n");
+	/* compacting moves the slices of the image; a streamed image is only written in place */
+	if (stream_mode && compact_output)
+	{
+		printf("ERROR: --stream can't be combined with --compact\n");
 
-                return(-3);
-        }
+		return(1);
+	}
 
-		fwrite((char *)buffer,filesize,1,f);
+	if (cache_dir && (mkdir(cache_dir, 0777) != 0) && (errno != EEXIST))
+	{
+		printf("ERROR: Creating cache directory failed\n");
 
-		fclose(f);
+		return(1);
 	}
 
-	if (!((buffer[0] == 0xCA) && (buffer[1] == 0xFE) && (buffer[2] == 0xBA) && (buffer[3] == 0xBE)))
-		printf("Patch report: %u instructions patched, %u bad instructions, patches bypassed: %s\n", num_patches, num_bad, bypass == TRUE ? "YES" : "NO");
+	init_insn_length_table(TRUE);
 
-	return(0);
-}
+	if (batch)
+		return process_batch(argv[argi], in_place ? NULL : argv[argi + 1], in_place);
 
+	return process_file(argv[argi], in_place ? argv[argi] : argv[argi + 1], in_place, &rep);
+}
+#endif
@@ -8,11 +8,7 @@
 
 #include <stdint.h>
 
-/* EXTENDED_PATCHER enables FISTTP/LDDQU patching support */
-
-#ifdef EXTENDED_PATCHER
-# define LDDQU			0xf00ff2
-#endif
+#define LDDQU			0xf00ff2
 #define CPUID			0xa20f
 #define SYSENTER		0x340f
 
@@ -20,13 +16,14 @@
 #define INSN_INVALID		0
 #define INSN_UNSUPPORTED	(-1)
 
+/* the longest instruction; get_insn_length reads no further */
+#define INSN_MAX_LEN		15
+
 /* STATUS_* are possible status codes written bit-packed to the location specified
  * by the status argument to get_insn_length */
 #define STATUS_NEEDS_PATCH     (1 << 0)
 #define STATUS_PADDING         (1 << 1)
-#ifdef EXTENDED_PATCHER
-# define STATUS_REST           (1 << 2)
-#endif
+#define STATUS_REST            (1 << 2)
 
 struct segment_command *getsegforpatch(struct mach_header *header, const char *seg_name);
 struct segment_command_64 *getsegforpatch_64(struct mach_header_64 *header, const char *seg_name);
@@ -34,18 +31,110 @@ struct segment_command_64 *getsegforpatch_64(struct mach_header_64 *header, cons
 struct section *getsectforpatch(struct mach_header *header, const char *segname, const char *sectname);
 struct section_64 *getsectforpatch_64(struct mach_header_64 *header, const char *segname, const char *sectname);
 
+/* RULE_* select what the patcher rewrites; RULE_REST makes it rest after absolute jumps.
+ * EXTENDED_PATCHER only changes the default set from RULES_STANDARD to RULES_EXTENDED. */
+#define RULE_CPUID		(1 << 0)
+#define RULE_SYSENTER_TRAP	(1 << 1)
+#define RULE_LDDQU		(1 << 2)
+#define RULE_FISTTP		(1 << 3)
+#define RULE_REST		(1 << 4)
+#define RULES_SITES		(RULE_CPUID|RULE_SYSENTER_TRAP|RULE_LDDQU|RULE_FISTTP)
+#define RULES_STANDARD		(RULE_CPUID|RULE_SYSENTER_TRAP)
+#define RULES_EXTENDED		(RULES_SITES|RULE_REST)
+
+void select_patch_rules(uint32_t rules);
+uint32_t selected_patch_rules(void);
+boolean_t parse_patch_rules(const char *list, uint32_t *rules);
+
 int32_t get_insn_length(uint8_t *insn, boolean_t is_64bit, uint8_t *status);
+void init_insn_length_table(boolean_t enable);
+
+/* PATCH_* are the kinds of instructions the patcher rewrites (see classify_insn) */
+#define PATCH_NONE		0
+#define PATCH_CPUID		1
+#define PATCH_SYSENTER_TRAP	2
+#define PATCH_LDDQU		3
+#define PATCH_FISTTP		4
+
+#define PATCH_USER		16	// PATCH_USER + n: user rule n
+
+/* user rules (--rule-file): masked byte patterns that are rewritten in place, matched only
+ * within one instruction of the linear decode, from its start.  a USER_RULE_WHOLE pattern
+ * must also end where the instruction ends. */
+#define USER_RULE_MAX_LEN	16
+#define USER_RULES_MAX		64
+#define USER_RULE_START		0
+#define USER_RULE_WHOLE		1
 
+struct user_rule {
+	char name[32];
+	uint32_t len;
+	uint32_t boundary;
+	uint8_t value[USER_RULE_MAX_LEN];
+	uint8_t mask[USER_RULE_MAX_LEN];	// bits of the byte the pattern compares
+	uint8_t replace[USER_RULE_MAX_LEN];
+	uint8_t keep[USER_RULE_MAX_LEN];	// bits of the old byte the rewrite keeps
+};
+
+boolean_t add_user_rule(const struct user_rule *rule);
+
+int classify_insn(uint8_t *insn, boolean_t is_64bit);
+void apply_patch(uint8_t *insn, int kind, boolean_t verbose);
 boolean_t patch_insn(uint8_t *insn, boolean_t verbose, boolean_t is_64bit);
 
+/* data_ranges are the sorted, non-overlapping [begin, end) byte ranges of a section that
+ * hold data (jump tables, literal pools, see LC_DATA_IN_CODE) and are never decoded */
+struct data_range {
+	uint64_t begin, end;
+};
+
+struct data_ranges {
+	struct data_range *ranges;
+	uint32_t num;
+};
+
 uint32_t scan_text_section(uint8_t *start, uint64_t size, uint64_t text_addr,
-		boolean_t should_patch, boolean_t abi_is_64, boolean_t verbose,
+		const struct data_ranges *data, boolean_t should_patch, boolean_t abi_is_64, boolean_t verbose,
 		uint32_t *num_patches_out);
 
+/* insn_map is the decode of a code section as two bitmaps of 1 bit per byte (bit n of word
+ * n / 64 for byte n): starts has the bits of the instruction starts set, bad those of the
+ * bad (invalid or unsupported) bytes.  data bytes and padding runs after their first byte
+ * are in neither.  map_insn_boundaries decodes the section once (in parallel where it can)
+ * to fill one; insn_map_find and insn_map_count then work a word at a time. */
+struct insn_map {
+	uint64_t size;
+	uint64_t *starts;
+	uint64_t *bad;
+};
+
+boolean_t map_insn_boundaries(uint8_t *start, uint64_t size, const struct data_ranges *data,
+		boolean_t abi_is_64, struct insn_map *map);
+boolean_t alloc_insn_map(struct insn_map *map, uint64_t size);
+void free_insn_map(struct insn_map *map);
+/* the first offset in [off, end) whose bit is set (or clear, with !set), end if none is */
+uint64_t insn_map_find(const uint64_t *bits, uint64_t off, uint64_t end, boolean_t set);
+/* the number of bits set in [begin, end) */
+uint64_t insn_map_count(const uint64_t *bits, uint64_t begin, uint64_t end);
+
+/* per-section results of patch_text_segment (sections is allocated, the caller frees it) */
+struct section_report {
+	char segname[16];
+	char sectname[16];
+	boolean_t bypass;
+	uint32_t num_patches;
+	uint32_t num_bad;
+};
+
+struct patch_report {
+	struct section_report *sections;
+	uint32_t num_sections;
+};
+
 kern_return_t patch_text_segment(uint8_t *addr, mach_vm_offset_t map_addr,
 		mach_vm_size_t map_size, boolean_t abi_is_64, boolean_t seg_is_64,
 		boolean_t verbose, boolean_t *bypass, uint32_t *num_patches_out,
-		uint32_t *num_bad_out);
+		uint32_t *num_bad_out, struct patch_report *report);
 
 /* magic numbers fine-tuned for accurate disassembly; don't mess with these unless
  * you really know what you are doing. */